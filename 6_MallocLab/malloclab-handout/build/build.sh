@@ -1,3 +1,3 @@
 #!/bin/sh
 
-docker run --rm -v /Users/hskimse/Desktop/prjt/CMU-15213-lab-sol/6_MallocLab/malloclab-handout:/app ubuntu32 sh -c "cd /app && make mdriver && ./mdriver -t ./traces/ -V -v"
+docker run --rm -v /Users/hskimse/Desktop/prjt/CMU-15213-lab-sol/6_MallocLab/malloclab-handout:/app ubuntu32 sh -c "cd /app && make ARCH=-m32 mdriver && ./mdriver -t ./traces/ -V -v"
@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -29,9 +30,13 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAXTHREADS    64 /* max threads for the -T option */
+#define MT_REPS       20 /* times each thread replays a trace with -T */
+#define PROF_BUCKETS  32 /* latency bucket i holds [2^i, 2^(i+1)) ns, -P */
+#define PROF_STEP    100 /* requests between two timeline samples with -P */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -72,6 +77,23 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* Holds the params and result of one thread of eval_mm_mt */
+typedef struct {
+    trace_t *trace;
+    char **blocks;       /* this thread's own ptrs for the trace ids */
+    char tag;            /* written to the first payload byte */
+    pthread_barrier_t *start;
+    int opnum;           /* failing request, or -1 if all went well */
+    char *msg;
+} mt_arg_t;
+
+/* The CSV files written by the -P option */
+typedef struct {
+    FILE *latency;   /* latency histogram of each request type */
+    FILE *timeline;  /* free lists every PROF_STEP requests */
+    FILE *frag;      /* fragmentation when the payload peaks */
+} prof_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -124,6 +146,16 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static double eval_mm_mt(trace_t *trace, int tracenum, int nthreads);
+static int trace_peak(trace_t *trace);
+static void *eval_mm_mt_thread(void *vargp);
+static void eval_mm_prof(trace_t *trace, int tracenum, char *filename,
+			 prof_t *prof);
+
+/* Helpers for the -P option; mm_info is optional in a package */
+extern void mm_info(mm_info_t *info) __attribute__((weak));
+static void prof_info(mm_info_t *info);
+static FILE *prof_open(char *prefix, char *name, char *header);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -150,6 +182,13 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int mt_threads = 0;  /* If set, also run traces in up to this many
+                            threads at once (set by -T) */
+    char *prof_prefix = NULL; /* If set, profile each trace into CSV files
+                                 named after this (set by -P) */
+    prof_t prof;
+    int t;
+    double base, kops;
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +197,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:T:P:hvVgal")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +223,16 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'T': /* Run each trace in several threads at once */
+            mt_threads = atoi(optarg);
+            if (mt_threads < 1 || mt_threads > MAXTHREADS) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'P': /* Profile each trace into CSV files */
+            prof_prefix = optarg;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -314,6 +363,65 @@ int main(int argc, char **argv)
 	printf("\n");
     }
 
+    /*
+     * Optionally measure how mm malloc scales when 1, 2, 4, ... threads
+     * replay each valid trace at the same time on the shared heap
+     */
+    if (mt_threads > 0) {
+	printf("Results for mm malloc, %d replays per thread:\n", MT_REPS);
+	printf("%5s%8s%10s%8s%9s\n",
+	       "trace", "threads", "secs", "Kops", "speedup");
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    base = 0;
+	    for (t = 1; t <= mt_threads;
+		 t = (t < mt_threads && 2*t > mt_threads) ? mt_threads : 2*t) {
+		/* Leave the allocator a quarter of the heap for overhead */
+		if ((double)t * trace_peak(trace) > 0.75 * MAX_HEAP) {
+		    printf("%2d%11d%27s\n", i, t, "(heap too small)");
+		    break;
+		}
+		if ((secs = eval_mm_mt(trace, i, t)) < 0)
+		    break;
+		kops = (double)t * MT_REPS * trace->num_ops / 1e3 / secs;
+		if (t == 1)
+		    base = kops;
+		printf("%2d%11d%10.6f%8.0f%9.2f\n", i, t, secs, kops, kops/base);
+	    }
+	    free_trace(trace);
+	}
+	printf("\n");
+    }
+
+    /*
+     * Optionally replay each valid trace once more, timing every request
+     * and watching the free lists, and write what we saw to CSV files
+     */
+    if (prof_prefix != NULL) {
+	prof.latency = prof_open(prof_prefix, "latency",
+				 "trace,op,lo_ns,hi_ns,count");
+	prof.timeline = prof_open(prof_prefix, "timeline",
+				  "trace,op,payload,footprint,free_blocks,"
+				  "free_bytes,searches,avg_depth");
+	prof.frag = prof_open(prof_prefix, "frag",
+			      "trace,file,peak_op,payload,footprint,internal,"
+			      "external,internal_pct,external_pct");
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    eval_mm_prof(trace, i, tracefiles[i], &prof);
+	    free_trace(trace);
+	}
+	fclose(prof.latency);
+	fclose(prof.timeline);
+	fclose(prof.frag);
+	printf("Profile written to %s-{latency,timeline,frag}.csv\n\n",
+	       prof_prefix);
+    }
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -395,9 +503,11 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of a
+       mapping the package got with mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -689,10 +799,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   largest size the heap reached while running the student's malloc 
+ *   package on the trace, plus what it had mapped with mem_map() at the
+ *   time. Our mem_sbrk() lets the heap shrink, so the final brk may be
+ *   below that.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
@@ -774,7 +884,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -825,6 +935,301 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_mt - Run trace in nthreads threads at once on one heap, each
+ *    thread MT_REPS times with blocks of its own, and return the elapsed
+ *    seconds, or -1 if some thread found an error.
+ */
+static double eval_mm_mt(trace_t *trace, int tracenum, int nthreads)
+{
+    pthread_t tid[MAXTHREADS];
+    mt_arg_t args[MAXTHREADS];
+    pthread_barrier_t start;
+    struct timespec t0, t1;
+    int i, ok = 1;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_mt");
+
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+	args[i].trace = trace;
+	if ((args[i].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+	    unix_error("calloc failed in eval_mm_mt");
+	args[i].tag = 'A' + i;
+	args[i].start = &start;
+	args[i].opnum = -1;
+	if (pthread_create(&tid[i], NULL, eval_mm_mt_thread, &args[i]) != 0)
+	    unix_error("pthread_create failed in eval_mm_mt");
+    }
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tid[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_barrier_destroy(&start);
+
+    for (i = 0; i < nthreads; i++) {
+	if (args[i].opnum >= 0) {
+	    malloc_error(tracenum, args[i].opnum, args[i].msg);
+	    ok = 0;
+	}
+	free(args[i].blocks);
+    }
+    if (!ok)
+	return -1;
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/*
+ * trace_peak - Return the largest total payload allocated at once by trace
+ */
+static int trace_peak(trace_t *trace)
+{
+    int i, index, total = 0, peak = 0;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	    total += trace->ops[i].size;
+	    trace->block_sizes[index] = trace->ops[i].size;
+	    break;
+	case REALLOC:
+	    total += trace->ops[i].size - trace->block_sizes[index];
+	    trace->block_sizes[index] = trace->ops[i].size;
+	    break;
+	case FREE:
+	    total -= trace->block_sizes[index];
+	    break;
+	}
+	peak = (total > peak) ? total : peak;
+    }
+    return peak;
+}
+
+/*
+ * eval_mm_mt_thread - Thread routine for eval_mm_mt. Every block is
+ *    tagged in its first byte, and the tag is checked before the block is
+ *    given back, which catches blocks handed to two threads at once.
+ *    Blocks still allocated at the end of a replay are freed.
+ */
+static void *eval_mm_mt_thread(void *vargp)
+{
+    mt_arg_t *ap = (mt_arg_t *)vargp;
+    trace_t *trace = ap->trace;
+    char **blocks = ap->blocks;
+    char *p;
+    int i, r, index, size;
+
+    pthread_barrier_wait(ap->start);
+    for (r = 0; r < MT_REPS; r++) {
+	for (i = 0;  i < trace->num_ops;  i++) {
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    switch (trace->ops[i].type) {
+
+	    case ALLOC: /* mm_malloc */
+		if ((p = mm_malloc(size)) == NULL) {
+		    ap->msg = "mm_malloc failed.";
+		    goto fail;
+		}
+		p[0] = ap->tag;
+		blocks[index] = p;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		if (blocks[index][0] != ap->tag)
+		    goto clobbered;
+		if ((p = mm_realloc(blocks[index], size)) == NULL) {
+		    ap->msg = "mm_realloc failed.";
+		    goto fail;
+		}
+		if (p[0] != ap->tag) {
+		    ap->msg = "mm_realloc did not preserve the data from "
+			"old block";
+		    goto fail;
+		}
+		blocks[index] = p;
+		break;
+
+	    case FREE: /* mm_free */
+		if (blocks[index][0] != ap->tag)
+		    goto clobbered;
+		mm_free(blocks[index]);
+		blocks[index] = NULL;
+		break;
+
+	    default:
+		app_error("Nonexistent request type in eval_mm_mt_thread");
+	    }
+	}
+	for (index = 0; index < trace->num_ids; index++) {
+	    if (blocks[index] != NULL) {
+		mm_free(blocks[index]);
+		blocks[index] = NULL;
+	    }
+	}
+    }
+    return NULL;
+
+ clobbered:
+    ap->msg = "Payload was overwritten by another thread";
+ fail:
+    ap->opnum = i;
+    return NULL;
+}
+
+/*
+ * eval_mm_prof - Replay the trace once, timing every request, and write
+ *    the results to the CSV files of prof:
+ *    - latency: for each request type, how many requests took [lo_ns,
+ *      hi_ns) nanoseconds, in power of 2 buckets. The clock is read
+ *      around each call, so the small buckets include its overhead.
+ *    - timeline: every PROF_STEP requests, the payload and footprint
+ *      (heap plus mappings), the free list length and bytes, and the
+ *      free list searches since the last sample with the free blocks
+ *      they looked at on average (see mm_info).
+ *    - frag: where the payload peaks, the footprint split into payload,
+ *      external fragmentation (bytes on the free lists) and internal
+ *      fragmentation (all the rest: headers, padding, and space kept
+ *      for requests of some size, such as unused slab objects).
+ */
+static void eval_mm_prof(trace_t *trace, int tracenum, char *filename,
+			 prof_t *prof)
+{
+    static char *opname[] = {"malloc", "free", "realloc"};
+    long hist[3][PROF_BUCKETS];
+    struct timespec t0, t1;
+    mm_info_t info, last, peak;
+    size_t total_size = 0, max_total_size = 0, footprint = 0;
+    size_t external, internal;
+    int i, b, index, size, peak_op = -1;
+    long ns;
+    char *p = NULL;
+
+    memset(hist, 0, sizeof(hist));
+    memset(&last, 0, sizeof(last));
+    memset(&peak, 0, sizeof(peak));
+
+    /* initialize the heap and the mm malloc package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_prof");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	    p = mm_malloc(size);
+	    break;
+	case REALLOC:
+	    p = mm_realloc(trace->blocks[index], size);
+	    break;
+	case FREE:
+	    mm_free(trace->blocks[index]);
+	    break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_prof");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+	for (b = 0; b < PROF_BUCKETS - 1 && ns >= (2L << b); b++)
+	    ;
+	hist[trace->ops[i].type][b]++;
+
+	/* Keep track of current total size of all allocated blocks */
+	switch (trace->ops[i].type) {
+	case REALLOC:
+	    total_size -= trace->block_sizes[index];
+	    /* Fall through */
+	case ALLOC:
+	    if (p == NULL)
+		app_error("mm_malloc or mm_realloc failed in eval_mm_prof");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    break;
+	case FREE:
+	    total_size -= trace->block_sizes[index];
+	    break;
+	}
+
+	/* Remember the heap where the payload peaks */
+	if (total_size > max_total_size) {
+	    max_total_size = total_size;
+	    peak_op = i;
+	    prof_info(&peak);
+	    footprint = mem_heapsize() + mem_mapsize();
+	}
+
+	if ((i + 1) % PROF_STEP == 0 || i == trace->num_ops - 1) {
+	    prof_info(&info);
+	    fprintf(prof->timeline, "%d,%d,%lu,%lu,%lu,%lu,%lu,%.2f\n",
+		    tracenum, i + 1, (unsigned long)total_size,
+		    (unsigned long)(mem_heapsize() + mem_mapsize()),
+		    (unsigned long)info.free_blocks,
+		    (unsigned long)info.free_bytes,
+		    (unsigned long)(info.searches - last.searches),
+		    info.searches == last.searches ? 0.0 :
+		    (double)(info.search_steps - last.search_steps) /
+		    (info.searches - last.searches));
+	    last = info;
+	}
+    }
+
+    for (i = 0; i < 3; i++)
+	for (b = 0; b < PROF_BUCKETS; b++)
+	    if (hist[i][b] != 0)
+		fprintf(prof->latency, "%d,%s,%ld,%ld,%ld\n", tracenum,
+			opname[i], b ? 1L << b : 0L, 2L << b, hist[i][b]);
+
+    if (peak_op < 0)
+	return;                 /* Nothing was ever allocated */
+    external = peak.free_bytes;
+    internal = footprint - external - max_total_size;
+    fprintf(prof->frag, "%d,%s,%d,%lu,%lu,%lu,%lu,%.1f,%.1f\n",
+	    tracenum, filename, peak_op, (unsigned long)max_total_size,
+	    (unsigned long)footprint, (unsigned long)internal,
+	    (unsigned long)external, 100.0 * internal / footprint,
+	    100.0 * external / footprint);
+}
+
+/*
+ * prof_info - Get the free list statistics of the mm package, or zeros
+ *    if it does not keep any
+ */
+static void prof_info(mm_info_t *info)
+{
+    memset(info, 0, sizeof(mm_info_t));
+    if (mm_info != NULL)
+	mm_info(info);
+}
+
+/*
+ * prof_open - Create the CSV file <prefix>-<name>.csv for -P and write
+ *    its header line
+ */
+static FILE *prof_open(char *prefix, char *name, char *header)
+{
+    char path[MAXLINE];
+    FILE *fp;
+
+    snprintf(path, MAXLINE, "%s-%s.csv", prefix, name);
+    if ((fp = fopen(path, "w")) == NULL) {
+	sprintf(msg, "Could not open %.900s in prof_open", path);
+	unix_error(msg);
+    }
+    fprintf(fp, "%s\n", header);
+    return fp;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1004,14 +1409,16 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>] [-T <n>] [-P <prefix>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-P <prefix> Profile each trace into <prefix>-{latency,timeline,frag}.csv.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace in 1, 2, 4, ..., n threads at once.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
@@ -2,7 +2,17 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            The heap lives in an anonymous mapping of MAX_HEAP bytes, so
+ *            only the pages in use take memory. The brk can move down
+ *            again, and the pages given back that way, or through
+ *            mem_release, are returned to the system with madvise.
+ *
+ *            Besides the heap, the package may ask for mappings of its
+ *            own (mem_map). They count toward the same footprint as the
+ *            heap, and are all unmapped when the heap is reset.
  */
+#define _GNU_SOURCE             /* For mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -18,20 +28,36 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static size_t mem_peak;      /* largest footprint since the last reset */
+
+typedef struct map {         /* A mapping made by mem_map */
+    char *lo;
+    size_t len;
+    struct map *next;
+} map_t;
+static map_t *mem_maps;      /* all mappings made since the last reset */
+static size_t mem_mapped;    /* bytes in them */
+
+static void mem_discard(char *lo, char *hi);
+static void mem_update_peak(void);
+static map_t **mem_find_map(char *addr);
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve the address space we will use to model the available VM */
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_peak = 0;
 }
 
 /* 
@@ -39,35 +65,195 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and unmap what mem_map handed out
  */
 void mem_reset_brk()
 {
+    map_t *mp;
+
+    while ((mp = mem_maps) != NULL) {
+	mem_maps = mp->next;
+	munmap(mp->lo, mp->len);
+	free(mp);
+    }
+    mem_mapped = 0;
     mem_brk = mem_start_brk;
+    mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, and the whole pages above the new
+ *    brk are given back to the system.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ((mem_brk + incr) > mem_max_addr) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+    if ((mem_brk + incr) < mem_start_brk) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Heap would be negative...\n");
+	return (void *)-1;
+    }
     mem_brk += incr;
+    mem_update_peak();
+    if (incr < 0)
+	mem_discard(mem_brk, old_brk);
     return (void *)old_brk;
 }
 
+/*
+ * mem_release - tell the system that the contents of the heap bytes
+ *    [addr, addr+len) are no longer needed. The whole pages among them
+ *    are given back and read as zeros when touched again.
+ */
+void mem_release(void *addr, size_t len)
+{
+    mem_discard((char *)addr, (char *)addr + len);
+}
+
+/*
+ * mem_discard - give back the whole pages within [lo, hi)
+ */
+static void mem_discard(char *lo, char *hi)
+{
+    size_t pagesize = mem_pagesize();
+    char *plo = mem_start_brk + 
+	(lo - mem_start_brk + pagesize - 1) / pagesize * pagesize;
+    char *phi = mem_start_brk + (hi - mem_start_brk) / pagesize * pagesize;
+
+    if (plo < phi)
+	madvise(plo, phi - plo, MADV_DONTNEED);
+}
+
+/*
+ * mem_map - model of an anonymous mmap: returns len bytes of fresh,
+ *    zeroed, page-aligned memory outside the heap, or (void *)-1
+ */
+void *mem_map(size_t len)
+{
+    map_t *mp;
+    char *lo;
+
+    if (mem_mapped + len > MAX_HEAP) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    lo = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lo == MAP_FAILED)
+	return (void *)-1;
+    if ((mp = (map_t *)malloc(sizeof(map_t))) == NULL) {
+	munmap(lo, len);
+	return (void *)-1;
+    }
+    mp->lo = lo;
+    mp->len = len;
+    mp->next = mem_maps;
+    mem_maps = mp;
+    mem_mapped += len;
+    mem_update_peak();
+    return (void *)lo;
+}
+
+/*
+ * mem_remap - resize the mapping at addr to len bytes. The pages are
+ *    moved rather than copied if it has to move. Returns its new
+ *    address, or (void *)-1, in which case the mapping is unchanged.
+ */
+void *mem_remap(void *addr, size_t len)
+{
+    map_t *mp = *mem_find_map((char *)addr);
+    char *lo;
+
+    assert(mp != NULL);
+    if (len > mp->len && mem_mapped + (len - mp->len) > MAX_HEAP) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    lo = mremap(mp->lo, mp->len, len, MREMAP_MAYMOVE);
+    if (lo == MAP_FAILED)
+	return (void *)-1;
+    mem_mapped = mem_mapped - mp->len + len;
+    mp->lo = lo;
+    mp->len = len;
+    mem_update_peak();
+    return (void *)lo;
+}
+
+/*
+ * mem_unmap - give back the mapping at addr
+ */
+void mem_unmap(void *addr)
+{
+    map_t **mpp = mem_find_map((char *)addr);
+    map_t *mp = *mpp;
+
+    assert(mp != NULL);
+    *mpp = mp->next;
+    munmap(mp->lo, mp->len);
+    mem_mapped -= mp->len;
+    free(mp);
+}
+
+/*
+ * mem_is_mapped - does [lo, hi] lie within a single mapping of mem_map?
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    map_t *mp;
+
+    for (mp = mem_maps; mp != NULL; mp = mp->next)
+	if ((char *)lo >= mp->lo && (char *)hi < mp->lo + mp->len)
+	    return 1;
+    return 0;
+}
+
+/*
+ * mem_mapsize - returns the bytes in the mappings of mem_map
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_find_map - return the link to the mapping that starts at addr
+ */
+static map_t **mem_find_map(char *addr)
+{
+    map_t **mpp = &mem_maps;
+
+    while (*mpp != NULL && (*mpp)->lo != addr)
+	mpp = &(*mpp)->next;
+    return mpp;
+}
+
+/*
+ * mem_update_peak - note the current footprint if it is the largest yet
+ */
+static void mem_update_peak(void)
+{
+    size_t size = mem_heapsize() + mem_mapped;
+
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +278,15 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest footprint since the last
+ *    reset: heap size plus the bytes of mem_map's mappings
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,9 +1,18 @@
 /**
- * mm.c - memory allocation module using explicit free list.
+ * mm.c - memory allocation module using boundary tags and segregated
+ *        free lists.
  *
- * Usable but needs improvement for certain cases.
+ * Free blocks sit on doubly linked lists by size class, and the largest
+ * ones in a splay tree ordered by size, so that malloc takes a best fit
+ * and free coalesces in constant time. Objects of up to SLAB_MAX bytes
+ * come from page-sized slab runs instead, and blocks of MMAP_MIN bytes
+ * or more get a mapping of their own. Threads share the heap under one
+ * lock, with a cache per thread for blocks and objects up to CACHE_MAX
+ * bytes. Each part
+ * is described in its own section below.
  * ----
- * NOTE: This code is for 32-bit system; Compile it with -m32 flag.
+ * NOTE: WORD follows the build: 4 with -m32 (8-byte alignment), 8 on a
+ * 64-bit build (16-byte alignment). The pictures below are for -m32.
  * ----ALIGNMENT----
  * mm_init() sets heap like this:
  *
@@ -43,41 +52,112 @@
  *    allocated(0). Macro `HDR_PFREE` is flag for pfree.
  * (alloc) - Flag that indicates either current block is allocated(1) or
  *    free(0). Macro `HDR_ALLOC` is flag for alloc.
+ * (ralloc) - Set on an allocated block that mm_realloc has grown. Such a
+ *    block is likely to grow again, so when it has to move it gets
+ *    1/REALLOC_RESERVE more room than asked for, and keeps that much
+ *    slack instead of giving it back. Macro `HDR_RALLOC` is flag for it.
+ * (mmap) - A huge block with a mapping of its own has (alloc) clear and
+ *    (pfree) set. No block handed out from the heap looks like that, as
+ *    those all have (alloc) set. Macro `HDR_MMAP` is flag for it.
  * The precise useage of each macros `HDR_FREE`, `HDR_PFREE`, `HDR_ALLOC`
  * is defined on the comment of function `set_header`.
  *
- * ----EXPLICIT FREE LIST----
- * The global variable TOP contains pointer to head of list node. Each list
- * nodes for each blocks are alligned on next eight bytes of header. So th-
- * -at, pointer to next node is given by *(void **)curr, when curr is
- * pointer to current node. By this rule, if blocksize is 8, storing
- * that block to list would override the footer. This can be resolv-
- * -ed by using flag FTR_VALID, which is described on next section.
+ * ----SEGREGATED FREE LISTS----
+ * Free blocks are kept on NBINS doubly linked lists, one per size class.
+ * Each list node is placed next to the header of its block: the first
+ * WORD holds the pointer to next node, the second the pointer to previous
+ * node (NODE_NEXT, NODE_PREV). With the header and footer that makes
+ * MIN_BLK = 4*WORD the smallest block, so a node never overlaps a footer.
  *
- * mm_free merge with prev and next block on heap, if either one is free.
- * However this is not as simple as implicit list because we do not know
- * (a)where the prev or next block is located on the free list, and
- * (b)value of pointer to previous node. So that we should handle
- * the four cases diffrently in here.
+ * Blocks up to SMALL_MAX bytes have a class per size, so every block on
+ * such a list fits exactly. Above that, each power of two is split in
+ * two classes. Bit i of BIN_MAP is set iff list i is not empty, so
+ * get_target_block looks for a best fit only in the request's own
+ * class and otherwise jumps straight to the first block of the nearest
+ * non-empty larger class, which is sure to fit.
  *
- * 1) prev alloc, next free
- * Modify list (p) -> next -> (n) to (p) -> next -> curr -> (n), and mark
- * header of prev as -1. This tided state would be resolved when traver-
- * -sing list on get_target_block. If size of next is less then 8,
- * pointer to curr is stored on the last 8 bytes of block that node curr
- * is placed, so setting footer for this block overrides it. Thus if
- * blocksize is 8, we will traverse list and replace next to
- * curr instead.
+ * Blocks of TREE_MIN bytes or more all go to the last class, TREE_BIN,
+ * which is a splay tree instead of a list: BINS[TREE_BIN] is its root,
+ * and the two node words are the left and right child (TREE_LEFT,
+ * TREE_RIGHT). Blocks are ordered by size, then by address, so every
+ * key is unique and any block can be found again to be deleted. The
+ * best fit for a large request is then the successor of (size, NULL),
+ * found in amortized O(log n) time.
  *
- * 2) prev free, next free
- * Delete the next node on the list. This will consume extra resource since
- * node_delete_s traverses entire list and delete the node.
+ * mm_free merges the block with the prev and next block on heap, if
+ * either one is free, taking those off their lists, and pushes the result
+ * on the list of its new size. Every node knows its neighbours, so taking
+ * a block off its list, and so freeing, takes constant time.
  *
- * 3) prev free, next alloc
- * In this case, there is nothing to do.
+ * ----SLABS----
+ * Requests of up to SLAB_MAX bytes are served from runs instead: a run
+ * is one RUN_SIZE page holding a run_t header and then objects of a
+ * single size, with no header of their own. Bit i of the run's bitmap
+ * is set iff object i is in use, so malloc is finding a zero bit and
+ * free is clearing one. Runs with free objects are kept on RUNS, one
+ * list per object size.
  *
- * 4) prev alloc, next alloc
- * Append current block to the TOP of list by calling node_top.
+ * A run is an ordinary allocated block whose payload starts on a page
+ * boundary (heap_memalign), so the run of an object is the page it lies
+ * in. SLAB_PAGES has a bit per page of the heap telling whether that
+ * page is a run; mm_free and mm_realloc check it, without the lock,
+ * before they look for a header. Its bits are set and cleared under the
+ * lock, with atomic or/and, as other bits of the same byte may be read
+ * meanwhile. A run that empties goes back to the heap unless it is the
+ * only one of its size with free objects.
+ *
+ * ----GIVING MEMORY BACK----
+ * When a free block of TRIM_MIN bytes or more ends up at the top of the
+ * heap, mm_free shrinks the heap with a negative mem_sbrk, leaving
+ * TRIM_KEEP bytes of it free for the requests to come. A free block of
+ * RELEASE_MIN or more stays listed, but the whole pages inside it, past
+ * its list node and before its footer, are handed back with mem_release;
+ * they read as zeros when they get used again. Pages of a large free
+ * neighbour were handed back when it was freed, so only the new part
+ * of a merged block is released.
+ *
+ * ----HUGE BLOCKS----
+ * A request for MMAP_MIN bytes or more gets a mapping of its own from
+ * mem_map instead of a heap block, so that it neither splits the heap
+ * nor leaves a hole in it when freed. The header sits at the end of
+ * the first ALIGNMENT bytes of the mapping and holds its length, with
+ * the HDR_MMAP flag. mm_free unmaps it, and mm_realloc resizes it with
+ * mem_remap, which moves pages instead of copying bytes. A heap block
+ * that mm_realloc has to move past MMAP_MIN moves to a mapping.
+ *
+ * ----THREADS----
+ * The heap and its lists are guarded by HEAP_LOCK, so mm_malloc, mm_free
+ * and mm_realloc may be called from any thread. mm_init must not race
+ * with them.
+ *
+ * Once a second thread shows up, blocks of up to CACHE_MAX bytes go
+ * through a per-thread cache in front of the heap: one LIFO list per
+ * class size, linked through the payload. Below SMALL_MAX the class sizes
+ * are those of the free lists; above it there are two per power of two,
+ * and a request is rounded up to the next one. A freed block goes on the
+ * list of the largest class size it holds, so every block on a list fits
+ * any request for it. The blocks on it stay marked allocated on the heap,
+ * so nothing else touches them. (Under the lock, a neighbour only ever
+ * flips the HDR_PFREE bit of an allocated block's header, while the
+ * block's owner reads the header without the lock. Both sides are atomic:
+ * HDR_SET_PFREE and HDR_CLR_PFREE against HDR_LOAD.) Slab objects have
+ * lists of their own in the same cache, one per object size, and are
+ * taken from and given back to their runs in the same way. An empty list
+ * is refilled with a batch of CACHE_BATCH blocks, or of CACHE_BYTES for
+ * larger ones, and a list holding more than CACHE_LIMIT batches gives
+ * half of them back, each under a single lock. When a thread exits, the
+ * destructor of CACHE_KEY gives back all of its cache. A single-threaded
+ * program never caches, so its heap looks just as it would without the
+ * caches. HEAP_SHARED is read and set with relaxed atomics: it only picks
+ * between two paths that are both safe, as everything they share is
+ * guarded by HEAP_LOCK.
+ *
+ * ----STATISTICS----
+ * INFO counts the blocks and bytes on the free lists, as node_push and
+ * node_delete add and take them, and the free list searches with the
+ * nodes they look at: list nodes in get_target_block, tree nodes on the
+ * way down in tree_fit's splay. Blocks in a slab run or a thread's
+ * cache are not on a list and do not count. mm_info reports INFO.
  *
  * ----FOOTER----
  * Note that on this structure, every free block has `footer`, exact duplicate
@@ -86,47 +166,47 @@
  *
  * The footer is used when (pfree) flag is turned on to next block, which is
  * crucial for allocater, to indicate previous block's size.
- *
- * Flag FTR_VALID is used for footer. Its defined as '4'. Since we using double
- * word alignment, every three low bits of each elements for list nodes are
- * zero. So when footer is overrided by list node, this flag will be over-
- * rided. And we place list nodes as next to the header, so this case is
- * occured only if the block's size is 8 byte.
  */
 
-/*
-   TODO: Deal with binary-bal.rep (which allocates 448 64, free 448 and then
-         allocates 512.) << HOW??
-         Implement segregated free list.
-*/
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
 
 static int    block_size;       /* Size of block founded by get_target_block */
-static void **prev_node;        /* Pointer to previous free block's node */
-static void **TOP;              /* Top node of explicit free list */
 
+static void *heap_malloc(size_t blocksize);
+static void *heap_memalign(void);
+static void *cache_malloc(int cls, size_t size);
+static void  cache_free(void *ptr, int cls);
+static int   cache_batch(int cls);
+static void  cache_flush(int cls, int keep);
+static void  cache_check(void);
+static void  cache_key_create(void);
+static void  cache_exit(void *arg);
+static int   heap_shared(void);
 static void *malloc_existing_block(size_t blocksize);
 static void *malloc_new_block(size_t blocksize);
-static int   free_coalesce(void *ptr);
+static void  free_coalesce(void *ptr);
 static void *get_target_block(size_t blocksize);
+static int   realloc_grow(void *hp, size_t blocksize);
 
 inline static void   set_header(void *header, size_t blocksize, int flag);
 inline static void   set_footer(void *header, size_t blocksize);
-inline static void **node_find_prev(void **curr);
-inline static void   node_delete(void **prev, void **curr);
-inline static void   node_delete_s(void **curr);
-inline static void   node_replace(void **prev, void **src, void **dst);
-inline static void   node_replace_s(void **src, void **dst);
-inline static void   node_top(void **node);
-inline static void   node_insert(void **prev, void **node);
+inline static int    size_class(size_t blocksize);
+inline static int    cache_class(size_t blocksize);
+inline static size_t cache_size(int cls);
+inline static void   node_delete(void **node, size_t blocksize);
+inline static void   node_push(void **node, size_t blocksize);
+static void        **tree_splay(void **t, size_t size, void **node);
+static void          tree_insert(void **node, size_t blocksize);
+static void          tree_delete(void **node, size_t blocksize);
+static void         *tree_fit(size_t blocksize);
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -143,15 +223,26 @@ team_t team = {
     ""
 };
 
-/* 32-bit */
-#define WORD 4
+/* Size of header, footer and list pointers */
+#if defined(__LP64__) || defined(_LP64)
+#define WORD 8                  /* 64-bit */
+#else
+#define WORD 4                  /* 32-bit, -m32 */
+#endif
 
 /* Double word alignment */
 #define ALIGNMENT (WORD*2)
 #define HDR_MASK  7
 
 /* Round up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~HDR_MASK)
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+/* Smallest block: header, two list pointers and footer */
+#define MIN_BLK (4*WORD)
+
+/* Blocksize for a payload of size bytes */
+#define BLK_SIZE(size) \
+    (ALIGN((size) + WORD) < MIN_BLK ? MIN_BLK : ALIGN((size) + WORD))
 
 /* Initialize heap with this size and padding */
 #define INIT_SIZE ALIGN(WORD)
@@ -168,10 +259,31 @@ team_t team = {
 #define HDR_PTR(ptr_to_pld)      ((void *)(ptr_to_pld) - WORD)
 #define HDR_ELE(ptr_to_hdr)      (*(size_t *)ptr_to_hdr)
 
+/* Links of a free list node */
+#define NODE_NEXT(node) (*(void ***)(node))
+#define NODE_PREV(node) (*((void ***)(node) + 1))
+#define TREE_LEFT(node)  NODE_NEXT(node)
+#define TREE_RIGHT(node) NODE_PREV(node)
+
+/* Size of the block whose free list node is node */
+#define NODE_SIZE(node) MM_SIZE(HDR_ELE(HDR_PTR(node)))
+
+/* Key (size, node) comes before the key of tree node t */
+#define KEY_LESS(size, node, t) \
+    ((size) < NODE_SIZE(t) || ((size) == NODE_SIZE(t) && (void **)(node) < (t)))
+
 /* Determine header or footer metadatas */
 #define IS_ALLOC(hdr_ele) ((hdr_ele) & HDR_ALLOC)
 #define IS_PFREE(hdr_ele) ((hdr_ele) & HDR_PFREE)
-#define IS_VALID(ftr_ele) ((ftr_ele) & FTR_VALID)
+#define IS_RALLOC(hdr_ele) ((hdr_ele) & HDR_RALLOC)
+#define IS_MMAP(hdr_ele) (((hdr_ele) & (HDR_ALLOC | HDR_MMAP)) == HDR_MMAP)
+
+/* The header of an allocated block is read by its owner without HEAP_LOCK,
+   while a neighbour may flip its HDR_PFREE under the lock; see THREADS */
+#define HDR_LOAD(hdr)      __atomic_load_n((size_t *)(hdr), __ATOMIC_RELAXED)
+#define HDR_SET_PFREE(hdr) __atomic_fetch_or((size_t *)(hdr), HDR_PFREE, __ATOMIC_RELAXED)
+#define HDR_CLR_PFREE(hdr) \
+    __atomic_fetch_and((size_t *)(hdr), ~(size_t)HDR_PFREE, __ATOMIC_RELAXED)
 
 /* Macros for parse size and flag for header element. */
 #define MM_SIZE(header) ((header) & ~HDR_MASK)
@@ -181,7 +293,94 @@ team_t team = {
 #define HDR_FREE  0             /* This block is free */
 #define HDR_ALLOC 1             /* This block is allocated */
 #define HDR_PFREE 2             /* Previous block is free */
-#define FTR_VALID 4             /* Valid footer */
+#define HDR_RALLOC 4            /* This block has been grown by mm_realloc */
+#define HDR_MMAP   HDR_PFREE    /* With HDR_ALLOC clear: block is mapped */
+
+/* Moved realloc'd blocks get 1/REALLOC_RESERVE extra room; 0 disables */
+#define REALLOC_RESERVE 4
+
+/* Size classes. Blocks up to SMALL_MAX get one class per size; above that
+   each power of two [2^k, 2^(k+1)) is split into two classes. */
+#define NBINS       64
+#define NSMALL      16
+#define SMALL_MAX   (NSMALL * ALIGNMENT)
+#define SMALL_SHIFT __builtin_ctz(SMALL_MAX) /* log2(SMALL_MAX) */
+#define TREE_MIN    (256 * ALIGNMENT)  /* Blocks this big go to the tree */
+#define TREE_BIN    (NBINS - 1)
+
+static void             **BINS[NBINS]; /* Top node of each free list, and
+                                          root of the tree at TREE_BIN */
+static unsigned long long BIN_MAP;     /* Bit i set iff BINS[i] != NULL */
+static mm_info_t          INFO;        /* Free list statistics; see mm_info */
+
+/* Free blocks this big go back to the system; see mem_sbrk, mem_release */
+#define TRIM_MIN    (1024 * 1024)       /* ... when at the top of heap */
+#define TRIM_KEEP   (256 * 1024)        /* Left on top for coming requests */
+#define RELEASE_MIN (1024 * 1024)       /* ... elsewhere, all but the ends */
+
+/* Blocks this big get a mapping of their own; see mem_map */
+#define MMAP_MIN    (128 * 1024)
+
+static size_t mmap_len(size_t size);
+static void  *mmap_malloc(size_t size);
+static void  *mmap_realloc(void *ptr, size_t size);
+
+/* Slab runs for objects up to SLAB_MAX bytes */
+#define SLAB_MAX    64
+#define SLAB_NCLS   (SLAB_MAX / ALIGNMENT)
+#define RUN_SIZE    4096                    /* Power of 2 */
+#define RUN_MAPLEN  (RUN_SIZE / ALIGNMENT / 64) /* Bitmap words of a run */
+#define SLAB_SPAN   (1UL << 30)             /* Heap bytes SLAB_PAGES covers */
+
+typedef struct run {
+    size_t              osize;          /* Size of each object */
+    int                 nobj;           /* Objects in the run */
+    int                 nfree;          /* Objects not in use */
+    struct run         *next;           /* Runs of osize with free objects */
+    struct run         *prev;
+    unsigned long long  map[RUN_MAPLEN]; /* Bit i set iff object i in use */
+} run_t;
+
+/* Run of an object, and first object of run rp */
+#define RUN_OF(ptr)  ((run_t *)((unsigned long)(ptr) & ~(RUN_SIZE - 1UL)))
+#define RUN_OBJS(rp) ((char *)(rp) + ALIGN(sizeof(run_t)))
+
+static run_t         *RUNS[SLAB_NCLS];  /* Runs with free objects per size */
+static char          *SLAB_BASE;        /* Page the heap starts in */
+static unsigned char  SLAB_PAGES[SLAB_SPAN / RUN_SIZE / 8]; /* Runs */
+
+static void  *run_align(void *p);
+static void  *slab_malloc(size_t size);
+static void   slab_free(run_t *rp, void *ptr);
+static run_t *slab_run(void *ptr);
+static void   slab_mark(run_t *rp, int on);
+
+/* Per-thread caches of blocks up to CACHE_MAX, one list per class size
+   (see cache_class), and of slab objects, one list per object size
+   after those */
+#define CACHE_MAX   TREE_MIN            /* Largest block cached */
+#define CACHE_NMED  8                   /* Classes in (SMALL_MAX, CACHE_MAX] */
+#define CACHE_NBLK  (NSMALL + CACHE_NMED)
+#define CACHE_NCLS  (CACHE_NBLK + SLAB_NCLS)
+#define CACHE_BATCH 16                  /* Most blocks moved per lock trip */
+#define CACHE_BYTES (16 * 1024)         /* ... or this many bytes of them */
+#define CACHE_LIMIT 4                   /* Give half back beyond 4 batches */
+#define CACHE_OBJ(size) \
+    (CACHE_NBLK + ((size) ? ALIGN(size) : ALIGNMENT) / ALIGNMENT - 1)
+
+typedef struct {
+    void    **top[CACHE_NCLS];          /* Cached blocks' payloads */
+    int       cnt[CACHE_NCLS];
+    unsigned  gen;                      /* HEAP_GEN the blocks belong to */
+} cache_t;
+
+static pthread_mutex_t HEAP_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t       HEAP_OWNER;      /* Thread that called mm_init */
+static int             HEAP_SHARED;     /* Another thread has called in */
+static unsigned        HEAP_GEN;        /* Bumped by mm_init */
+static __thread cache_t CACHE;
+static pthread_key_t   CACHE_KEY;       /* Calls cache_exit on thread exit */
+static pthread_once_t  CACHE_ONCE = PTHREAD_ONCE_INIT;
 
 /* #define DEBUG */
 
@@ -213,7 +412,15 @@ int mm_init(void)
 {
     /* Initialize global variables */
     block_size = 0;
-    TOP = NULL;
+    memset(BINS, 0, sizeof(BINS));
+    BIN_MAP = 0;
+    memset(&INFO, 0, sizeof(INFO));
+    HEAP_OWNER = pthread_self();
+    __atomic_store_n(&HEAP_SHARED, 0, __ATOMIC_RELAXED);
+    HEAP_GEN++;                 /* Blocks in any cache are gone with heap */
+    memset(RUNS, 0, sizeof(RUNS));
+    memset(SLAB_PAGES, 0, sizeof(SLAB_PAGES));
+    SLAB_BASE = (char *)RUN_OF(mem_heap_lo());
 
     /* allocate initial block */
     void *p;
@@ -226,17 +433,44 @@ int mm_init(void)
 }
 
 /*
- * mm_malloc - Allocate appropriate free block by tranversing
- *        implicit free list.
+ * mm_malloc - Allocate a tiny object from a slab run, a huge block from a
+ *        mapping of its own, or appropriate free block from the free
+ *        lists. Tiny objects and small blocks come from the calling
+ *        thread's cache once the heap is shared.
  */
 void *mm_malloc(size_t size)
 {
     void         *p;
-    const size_t  blksize = ALIGN(size + WORD);
+    const size_t  blksize = BLK_SIZE(size);
+    const int     shared  = heap_shared();
+
+    if (size <= SLAB_MAX) {
+        if (shared)
+            p = cache_malloc(CACHE_OBJ(size), size);
+        else {
+            pthread_mutex_lock(&HEAP_LOCK);
+            p = slab_malloc(size);
+            pthread_mutex_unlock(&HEAP_LOCK);
+        }
+        if (p != NULL)
+            return p;           /* Else no run could be made: use a block */
+    }
+    if (blksize >= MMAP_MIN) {
+        pthread_mutex_lock(&HEAP_LOCK);
+        p = mmap_malloc(size);
+        pthread_mutex_unlock(&HEAP_LOCK);
+        if (p != NULL)
+            return p;           /* Else no mapping: try the heap */
+    }
+    if (shared && blksize <= CACHE_MAX) {
+        const int cls = cache_class(blksize - 1) + 1; /* Least fitting */
+        return cache_malloc(cls, cache_size(cls));
+    }
 
-    if ((p = malloc_existing_block(blksize)) != NULL)
-        return p;
-    return malloc_new_block(blksize);
+    pthread_mutex_lock(&HEAP_LOCK);
+    p = heap_malloc(blksize);
+    pthread_mutex_unlock(&HEAP_LOCK);
+    return p;
 }
 
 /*
@@ -244,17 +478,48 @@ void *mm_malloc(size_t size)
  */
 void mm_free(void *ptr)
 {
-    if (free_coalesce(ptr))
-        node_top((void **)ptr);
+    run_t     *rp;
+    const int  shared = __atomic_load_n(&HEAP_SHARED, __ATOMIC_RELAXED);
+
+    if ((rp = slab_run(ptr)) != NULL) {
+        if (shared) {
+            cache_free(ptr, CACHE_OBJ(rp->osize));
+            return;
+        }
+        pthread_mutex_lock(&HEAP_LOCK);
+        slab_free(rp, ptr);
+        pthread_mutex_unlock(&HEAP_LOCK);
+        return;
+    }
+
+    const size_t hele    = HDR_LOAD(HDR_PTR(ptr));
+    const size_t blksize = MM_SIZE(hele);
+    int          cls;
+
+    if (IS_MMAP(hele)) {
+        pthread_mutex_lock(&HEAP_LOCK);
+        mem_unmap(ptr - ALIGNMENT);
+        pthread_mutex_unlock(&HEAP_LOCK);
+        return;
+    }
+    if (shared && (cls = cache_class(blksize)) < CACHE_NBLK) {
+        cache_free(ptr, cls);
+        return;
+    }
+    pthread_mutex_lock(&HEAP_LOCK);
+    free_coalesce(ptr);
 
     DBG_CHECK
+    pthread_mutex_unlock(&HEAP_LOCK);
 }
 
 /*
  * mm_realloc - Change the size of the allocation pointed to by ptr to size, and
- *       returns ptr. If there is not enough room to enlarge, it creates a new
- *       allocation, copies the old data, frees the old allocation, and returns
- *       a pointer to the allocated memory.
+ *       returns ptr. The block grows in place if the next block is free or
+ *       the heap can be extended behind it, and a huge block is resized
+ *       with mem_remap. If there is not enough room to enlarge, it creates
+ *       a new allocation, copies the old data, frees the old allocation,
+ *       and returns a pointer to the allocated memory.
  */
 void *mm_realloc(void *ptr, size_t size)
 {
@@ -265,31 +530,463 @@ void *mm_realloc(void *ptr, size_t size)
         return NULL;
     }
 
-    size_t        blksize = ALIGN(size + WORD);
+    run_t *rp;
+    if ((rp = slab_run(ptr)) != NULL) {     /* Objects have no header */
+        if (size <= rp->osize)
+            return ptr;
+        void *nptr = mm_malloc(size);
+        if (nptr == NULL)
+            return NULL;
+        memcpy(nptr, ptr, rp->osize);
+        mm_free(ptr);
+        return nptr;
+    }
+
+    size_t        blksize = BLK_SIZE(size);
     void         *hp      = HDR_PTR(ptr); /* Pointer to header */
-    const size_t  hele    = HDR_ELE(hp);
+    const size_t  hele    = HDR_LOAD(hp);
     const size_t  oldsize = MM_SIZE(hele);
-
-    if (blksize == oldsize)
-        return ptr;
+    void         *nptr;
+
+    if (IS_MMAP(hele)) {
+        if (blksize >= MMAP_MIN) {          /* Stays huge: move the pages */
+            pthread_mutex_lock(&HEAP_LOCK);
+            nptr = mmap_realloc(ptr, size);
+            pthread_mutex_unlock(&HEAP_LOCK);
+            if (nptr != NULL)
+                return nptr;                /* Else no mapping: copy it */
+        }
+        if ((nptr = mm_malloc(size)) == NULL)
+            return NULL;
+        if (size > oldsize - ALIGNMENT)
+            size = oldsize - ALIGNMENT;     /* Copy only what the map held */
+        memcpy(nptr, ptr, size);
+        mm_free(ptr);
+        return nptr;
+    }
+    if (blksize <= oldsize && oldsize - blksize < MIN_BLK)
+        return ptr;             /* Remainder would be too small to free */
+    if (blksize <= oldsize && IS_RALLOC(hele) && REALLOC_RESERVE &&
+        oldsize - blksize <= blksize / REALLOC_RESERVE)
+        return ptr;             /* Keep the reserve of a growing block */
+
+    /* Neighbours may flip HDR_PFREE meanwhile: reread header under lock */
+    pthread_mutex_lock(&HEAP_LOCK);
     if (blksize < oldsize) {
         /* Set blocksize to blk remaining flags */
-        HDR_ELE(hp) = hele - blksize + oldsize;
+        HDR_ELE(hp) = blksize | MM_FLAG(HDR_ELE(hp));
 
-        /* Set next block's header */
-        set_header(hp + blksize, oldsize - blksize, HDR_FREE);
-        set_footer(hp + blksize, oldsize - blksize);
+        /* Free the remainder as a block of its own */
+        set_header(hp + blksize, oldsize - blksize, HDR_ALLOC);
+        free_coalesce(PLD_PTR(hp + blksize));
+        pthread_mutex_unlock(&HEAP_LOCK);
+        return ptr;
+    }
+    if (realloc_grow(hp, blksize)) {
+        pthread_mutex_unlock(&HEAP_LOCK);
         return ptr;
     }
-    void *nptr = mm_malloc(size);
-    memcpy(nptr, ptr, oldsize - WORD);
-    mm_free(ptr);
+
+    /* Has to move; give a block that grows again some room to do so */
+    nptr = NULL;
+    if (blksize >= MMAP_MIN)
+        nptr = mmap_malloc(size);       /* From now on, mem_remap moves it */
+    if (nptr == NULL) {                 /* Else no mapping: try the heap */
+        if (IS_RALLOC(hele) && REALLOC_RESERVE)
+            size += size / REALLOC_RESERVE;
+        if ((nptr = heap_malloc(BLK_SIZE(size))) != NULL)
+            HDR_ELE(HDR_PTR(nptr)) |= HDR_RALLOC;
+    }
+    pthread_mutex_unlock(&HEAP_LOCK);
+    if (nptr == NULL)
+        return NULL;
+    memcpy(nptr, ptr, oldsize - WORD);  /* Both blocks are ours meanwhile */
+
+    pthread_mutex_lock(&HEAP_LOCK);
+    free_coalesce(ptr);
+    pthread_mutex_unlock(&HEAP_LOCK);
     return nptr;
 }
 
+/*
+ * mm_info - Report the free list statistics kept since mm_init.
+ */
+void mm_info(mm_info_t *info)
+{
+    pthread_mutex_lock(&HEAP_LOCK);
+    *info = INFO;
+    pthread_mutex_unlock(&HEAP_LOCK);
+}
+
 /**********************
  * My helper routines *
  **********************/
+/*
+ * heap_malloc - Allocate a block of blocksize from the free lists, or
+ *     from new heap. Caller holds HEAP_LOCK.
+ */
+static void *heap_malloc(size_t blocksize)
+{
+    void *p;
+
+    if ((p = malloc_existing_block(blocksize)) != NULL)
+        return p;
+    return malloc_new_block(blocksize);
+}
+
+/*
+ * heap_memalign - Allocate a run: a block of RUN_SIZE whose payload starts
+ *     at a multiple of RUN_SIZE, so that it fills a page but for its last
+ *     word, the header of the next block. A free block with room for one
+ *     anywhere is used, or else the heap is extended just far enough. The
+ *     space before and after the run is freed again. Returns the payload.
+ *     Caller holds HEAP_LOCK.
+ */
+static void *heap_memalign(void)
+{
+    void    *p, *hp, *run;
+    size_t   hele, front, back, runsize = RUN_SIZE;
+
+    if ((p = malloc_existing_block(2 * RUN_SIZE + MIN_BLK)) == NULL) {
+        /* The new block starts where malloc_new_block will put it */
+        hp = LAST_BLK_HDR;
+        if (IS_PFREE(HDR_ELE(hp)))
+            hp -= MM_SIZE(FTR_ELE(hp));
+        run = run_align(PLD_PTR(hp));
+        if ((p = malloc_new_block(run - PLD_PTR(hp) + RUN_SIZE)) == NULL)
+            return NULL;
+    }
+    hp   = HDR_PTR(p);
+    hele = HDR_ELE(hp);
+    run  = run_align(p);
+    front = run - p;
+    back  = MM_SIZE(hele) - front - runsize;
+    if (back < MIN_BLK) {       /* Too small to free; keep it in the run */
+        runsize += back;
+        back = 0;
+    }
+
+    if (front != 0) {
+        set_header(hp, front, MM_FLAG(hele));
+        set_header(HDR_PTR(run), runsize, HDR_ALLOC);
+        free_coalesce(p);       /* Marks the run "Previous free" */
+    } else
+        set_header(hp, runsize, MM_FLAG(hele));
+    if (back != 0) {
+        set_header(HDR_PTR(run) + runsize, back, HDR_ALLOC);
+        free_coalesce(run + runsize);
+    }
+    return run;
+}
+
+/*
+ * mmap_len - Return the length of the mapping for a huge block of size
+ *     payload bytes: room for its header, rounded up to whole pages.
+ */
+static size_t mmap_len(size_t size)
+{
+    const size_t page = mem_pagesize();
+
+    return (size + ALIGNMENT + page - 1) / page * page;
+}
+
+/*
+ * mmap_malloc - Allocate a huge block of size bytes in a mapping of its
+ *     own. Returns NULL if there is no mapping to be had. Caller holds
+ *     HEAP_LOCK, which also guards memlib.
+ */
+static void *mmap_malloc(size_t size)
+{
+    const size_t  len = mmap_len(size);
+    void         *p;
+
+    if ((p = mem_map(len)) == (void *)-1)
+        return NULL;
+    set_header(p + ALIGNMENT - WORD, len, HDR_MMAP);
+    return p + ALIGNMENT;
+}
+
+/*
+ * mmap_realloc - Resize huge block ptr to size bytes by resizing its
+ *     mapping, which may move it. Returns the payload, or NULL if the
+ *     mapping could not grow, ptr being left as it was. Caller holds
+ *     HEAP_LOCK.
+ */
+static void *mmap_realloc(void *ptr, size_t size)
+{
+    const size_t  len = mmap_len(size);
+    void         *p;
+
+    if (len == MM_SIZE(HDR_ELE(HDR_PTR(ptr))))
+        return ptr;
+    if ((p = mem_remap(ptr - ALIGNMENT, len)) == (void *)-1)
+        return NULL;
+    set_header(p + ALIGNMENT - WORD, len, HDR_MMAP);
+    return p + ALIGNMENT;
+}
+
+/*
+ * run_align - Return the first page boundary at or after payload p that
+ *     leaves room for a free block between them.
+ */
+static void *run_align(void *p)
+{
+    void *run = (void *)RUN_OF(p + RUN_SIZE - 1);
+
+    if (run != p && run - p < MIN_BLK)
+        run += RUN_SIZE;
+    return run;
+}
+
+/*
+ * slab_malloc - Allocate an object of size bytes from a run, making a new
+ *     run if no run of that size has a free object. Returns NULL only if
+ *     no run could be made. Caller holds HEAP_LOCK.
+ */
+static void *slab_malloc(size_t size)
+{
+    const size_t  osize = size ? ALIGN(size) : ALIGNMENT;
+    const int     cls   = osize / ALIGNMENT - 1;
+    run_t        *rp    = RUNS[cls];
+    int           i, bit;
+
+    if (rp == NULL) {
+        if ((rp = heap_memalign()) == NULL)
+            return NULL;
+        if ((char *)rp - SLAB_BASE >= (long)SLAB_SPAN) {
+            free_coalesce(rp);  /* Beyond SLAB_PAGES; use blocks */
+            return NULL;
+        }
+        memset(rp, 0, sizeof(run_t));
+        rp->osize = osize;
+        rp->nobj  = (RUN_SIZE - WORD - ALIGN(sizeof(run_t))) / osize;
+        rp->nfree = rp->nobj;
+        for (i = rp->nobj; i < RUN_MAPLEN * 64; i++) /* No such objects */
+            rp->map[i / 64] |= 1ULL << (i % 64);
+        slab_mark(rp, 1);
+        RUNS[cls] = rp;
+    }
+
+    for (i = 0; rp->map[i] == ~0ULL; i++)
+        ;
+    bit = __builtin_ctzll(~rp->map[i]);
+    rp->map[i] |= 1ULL << bit;
+    if (--rp->nfree == 0) {     /* Full: off the list */
+        RUNS[cls] = rp->next;
+        if (rp->next != NULL)
+            rp->next->prev = NULL;
+        rp->next = NULL;
+    }
+    return RUN_OBJS(rp) + (i * 64 + bit) * osize;
+}
+
+/*
+ * slab_free - Free object ptr of run rp. A run that was full goes back on
+ *     its list; a run that gets empty goes back to the heap, unless it is
+ *     the only one on its list. Caller holds HEAP_LOCK.
+ */
+static void slab_free(run_t *rp, void *ptr)
+{
+    const int idx = ((char *)ptr - RUN_OBJS(rp)) / rp->osize;
+    const int cls = rp->osize / ALIGNMENT - 1;
+
+    rp->map[idx / 64] &= ~(1ULL << (idx % 64));
+    if (rp->nfree++ == 0) {     /* Was full: on top of the list */
+        rp->prev = NULL;
+        rp->next = RUNS[cls];
+        if (RUNS[cls] != NULL)
+            RUNS[cls]->prev = rp;
+        RUNS[cls] = rp;
+    }
+    if (rp->nfree == rp->nobj && (rp->next != NULL || rp->prev != NULL)) {
+        if (rp->prev != NULL)
+            rp->prev->next = rp->next;
+        else
+            RUNS[cls] = rp->next;
+        if (rp->next != NULL)
+            rp->next->prev = rp->prev;
+        slab_mark(rp, 0);
+        free_coalesce(rp);
+    }
+}
+
+/*
+ * slab_run - Return the run ptr lies in, or NULL if ptr is not an object.
+ *     Called without HEAP_LOCK, so the bitmap is read atomically: a bit
+ *     only changes under the lock, and never for a page holding ptr while
+ *     the caller owns ptr.
+ */
+static run_t *slab_run(void *ptr)
+{
+    unsigned long page;
+    unsigned char bits;
+
+    if ((char *)ptr < SLAB_BASE)
+        return NULL;
+    page = ((char *)RUN_OF(ptr) - SLAB_BASE) / RUN_SIZE;
+    if (page >= SLAB_SPAN / RUN_SIZE)
+        return NULL;
+    bits = __atomic_load_n(&SLAB_PAGES[page / 8], __ATOMIC_RELAXED);
+    if (!(bits & (1 << page % 8)))
+        return NULL;
+    return RUN_OF(ptr);
+}
+
+/*
+ * slab_mark - Mark the page of run rp as a run (on) or not. Caller holds
+ *     HEAP_LOCK; the bits of other pages in the byte may be read at the
+ *     same time by slab_run, hence the atomic or/and.
+ */
+static void slab_mark(run_t *rp, int on)
+{
+    const unsigned long page = ((char *)rp - SLAB_BASE) / RUN_SIZE;
+    const unsigned char bit  = 1 << page % 8;
+
+    if (on)
+        __atomic_fetch_or(&SLAB_PAGES[page / 8], bit, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and(&SLAB_PAGES[page / 8], (unsigned char)~bit,
+                           __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_malloc - Allocate from list cls of the calling thread's cache: a
+ *     block of size bytes if size is cache_size(cls), or a slab object of
+ *     size bytes if cls is CACHE_OBJ(size). An empty list is refilled
+ *     from the heap or the runs.
+ */
+static void *cache_malloc(int cls, size_t size)
+{
+    void      **p;
+    int         i, n;
+
+    cache_check();
+    if (CACHE.top[cls] == NULL) {
+        n = cache_batch(cls);
+        pthread_mutex_lock(&HEAP_LOCK);
+        for (i = 0; i < n; i++) {
+            p = cls < CACHE_NBLK ? heap_malloc(size) : slab_malloc(size);
+            if (p == NULL)
+                break;
+            NODE_NEXT(p) = CACHE.top[cls];
+            CACHE.top[cls] = p;
+            CACHE.cnt[cls]++;
+        }
+        pthread_mutex_unlock(&HEAP_LOCK);
+        if (CACHE.top[cls] == NULL)
+            return NULL;
+    }
+    p = CACHE.top[cls];
+    CACHE.top[cls] = NODE_NEXT(p);
+    CACHE.cnt[cls]--;
+    return p;
+}
+
+/*
+ * cache_free - Put a block or slab object on list cls of the calling
+ *     thread's cache, giving half of the list back when it grows longer
+ *     than CACHE_LIMIT batches.
+ */
+static void cache_free(void *ptr, int cls)
+{
+    const int n = CACHE_LIMIT * cache_batch(cls);
+
+    cache_check();
+    NODE_NEXT(ptr) = CACHE.top[cls];
+    CACHE.top[cls] = ptr;
+    if (++CACHE.cnt[cls] > n)
+        cache_flush(cls, n / 2);
+}
+
+/*
+ * cache_batch - Return how many blocks list cls moves per lock round
+ *     trip: CACHE_BATCH, or fewer large blocks, CACHE_BYTES worth.
+ */
+static int cache_batch(int cls)
+{
+    size_t size;
+
+    if (cls >= CACHE_NBLK)
+        return CACHE_BATCH;             /* Objects are no more than blocks */
+    size = cache_size(cls);
+    return size * CACHE_BATCH > CACHE_BYTES ? CACHE_BYTES / size : CACHE_BATCH;
+}
+
+/*
+ * cache_flush - Free the blocks on the calling thread's list cls to the
+ *     heap, or the objects to their runs, until keep of them are left.
+ */
+static void cache_flush(int cls, int keep)
+{
+    void **p;
+
+    pthread_mutex_lock(&HEAP_LOCK);
+    while (CACHE.cnt[cls] > keep) {
+        p = CACHE.top[cls];
+        CACHE.top[cls] = NODE_NEXT(p);
+        CACHE.cnt[cls]--;
+        if (cls < CACHE_NBLK)
+            free_coalesce(p);
+        else
+            slab_free(RUN_OF(p), p);
+    }
+    pthread_mutex_unlock(&HEAP_LOCK);
+}
+
+/*
+ * cache_check - Make the calling thread's cache fit for use: empty it if
+ *     the heap was reset since it was last used, and make sure that
+ *     cache_exit runs when the thread exits.
+ */
+static void cache_check(void)
+{
+    if (CACHE.gen == HEAP_GEN)
+        return;
+    memset(&CACHE, 0, sizeof(CACHE));   /* Blocks went with the old heap */
+    CACHE.gen = HEAP_GEN;
+    pthread_once(&CACHE_ONCE, cache_key_create);
+    if (pthread_getspecific(CACHE_KEY) == NULL)
+        pthread_setspecific(CACHE_KEY, &CACHE);
+}
+
+/*
+ * cache_key_create - Create CACHE_KEY, once per process.
+ */
+static void cache_key_create(void)
+{
+    pthread_key_create(&CACHE_KEY, cache_exit);
+}
+
+/*
+ * cache_exit - Destructor of CACHE_KEY: give every block in the exiting
+ *     thread's cache back to the heap.
+ */
+static void cache_exit(void *arg)
+{
+    int cls;
+
+    (void)arg;
+    if (CACHE.gen != HEAP_GEN)
+        return;                         /* Blocks went with the old heap */
+    for (cls = 0; cls < CACHE_NCLS; cls++)
+        if (CACHE.cnt[cls] != 0)
+            cache_flush(cls, 0);
+}
+
+/*
+ * heap_shared - Return whether threads other than the one that called
+ *     mm_init use the heap, noting the calling thread if it is one.
+ */
+static int heap_shared(void)
+{
+    if (__atomic_load_n(&HEAP_SHARED, __ATOMIC_RELAXED))
+        return 1;
+    if (pthread_equal(pthread_self(), HEAP_OWNER))
+        return 0;
+    __atomic_store_n(&HEAP_SHARED, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
 /*
  * malloc_existing_block - Try to allocate requested blocksize block from
  *     existing block by calling get_target_block. If there is appropria-
@@ -301,9 +998,16 @@ static void *malloc_existing_block(size_t blocksize)
     void *p;
     /* Traverse the free list. */
     if ((p = get_target_block(blocksize)) != NULL) {
-        const size_t surplus = block_size - blocksize; /* Size of remainder space */
+        size_t surplus = block_size - blocksize; /* Size of remainder space */
+
+        /* Too small a remainder can't hold a node; keep it in the block */
+        if (surplus < MIN_BLK) {
+            blocksize = block_size;
+            surplus = 0;
+        }
 
-        /* Mark target block as use */
+        /* Take target block off its list and mark it as use */
+        node_delete((void **)PLD_PTR(p), block_size);
         set_header(p, blocksize, HDR_ALLOC);
 
         /* Mark empty space as free if there is empty space */
@@ -311,11 +1015,10 @@ static void *malloc_existing_block(size_t blocksize)
         if (surplus != 0) {
             set_header(nh, surplus, HDR_FREE);
             set_footer(nh, surplus);
-            node_replace(prev_node, (void **)PLD_PTR(p), (void **)PLD_PTR(nh));
+            node_push((void **)PLD_PTR(nh), surplus);
         } else {                /* There is no empty space */
             /* Mark next block as "Previous alloc" */
-            HDR_ELE(nh) = HDR_ELE(nh) & ~HDR_PFREE;
-            node_delete(prev_node, (void **)PLD_PTR(p));
+            HDR_CLR_PFREE(nh);
         }
         return PLD_PTR(p);
     }
@@ -339,7 +1042,7 @@ static void *malloc_new_block(size_t blocksize)
         const size_t pbsize = MM_SIZE(FTR_ELE(p)); /* Previous block's size */
         require -= pbsize;
         p -= pbsize;
-        node_delete_s((void **)PLD_PTR(p));
+        node_delete((void **)PLD_PTR(p), pbsize);
     }
 
     /* Request more heap !! */
@@ -354,115 +1057,171 @@ static void *malloc_new_block(size_t blocksize)
 
 /*
  * free_coalesce - When freeing the block, coalesce with the previous or next
- *      adjacent block if it is free. This function sets the header and footer
- *      of the block, and returns 1 if the coalesce is happend, 0 if not.
+ *      adjacent block if it is free, taking them off their lists. This
+ *      function sets the header and footer of the resulting block and
+ *      pushes it on the list of its size class, or trims it off the heap
+ *      if it is large and on top.
  */
-int free_coalesce(void *ptr)
+static void free_coalesce(void *ptr)
 {
-    void         **curr    = (void **)ptr; /* Pointer to node */
     void          *p       = HDR_PTR(ptr); /* Pointer to header */
     const size_t   hele    = HDR_ELE(p); /* Header element */
     size_t         blksize = MM_SIZE(hele); /* Blocksize */
-
-    int isnotmerged = 1;
+    void          *lo      = p;          /* Bytes not yet given back ... */
+    void          *hi      = p + blksize; /* ... unless merged with these */
 
     /* Merge with previous block */
     if (IS_PFREE(hele)) {
-        size_t ftr = FTR_ELE(p); /* Header element of previous block */
+        const size_t pbsize = MM_SIZE(FTR_ELE(p)); /* Previous block's size */
 
-        /* Only 8-byte block's footer is overrided by list node. */
-        if (!IS_VALID(ftr))
-            ftr = *((size_t *)p - 2);
+        /* Its pages are already given back, but for its footer */
+        if (pbsize >= RELEASE_MIN)
+            lo -= WORD;
+        else
+            lo -= pbsize;
 
         /* Merge two blocks */
-        blksize += MM_SIZE(ftr);
-        p -= MM_SIZE(ftr);
-
-        isnotmerged = 0;
+        blksize += pbsize;
+        p -= pbsize;
+        node_delete((void **)PLD_PTR(p), pbsize);
     }
 
     /* Merge with next block */
     void         *nh    = p + blksize; /* Pointer to next block's header */
     const size_t  nhele = HDR_ELE(nh); /* Header element of next block */
     if (!IS_ALLOC(nhele)) {
-        void **next = (void **)PLD_PTR(nh); /* Pointer to next block's node */
-        if (isnotmerged) { /* prev alloc, next free */
-            if (MM_SIZE(nhele) > 8) {
-                /* Defer process to get_target_block. See header comment. */
-                node_insert(next, curr);
-                HDR_ELE(nh) = -1U;
-            } else {
-                /**
-                 * TODO: improve this to not search entire list.
-                 *
-                 * If size of the next block is less then 8, footer of curr
-                 * overwrites node "next".
-                 */
-                node_replace_s(next, curr);
-            }
-        } else { /* prev free, next free */
-            node_delete_s(next);
-        }
+        node_delete((void **)PLD_PTR(nh), MM_SIZE(nhele));
         blksize += MM_SIZE(nhele);
 
-        isnotmerged = 0;
+        /* Same for its header and node */
+        if (MM_SIZE(nhele) >= RELEASE_MIN)
+            hi += 3 * WORD;
+        else
+            hi += MM_SIZE(nhele);
+    }
+
+    /* A large block on top of heap is trimmed down to TRIM_KEEP bytes */
+    void *np = p + blksize;                 /* Pointer to next block's header */
+    if (MM_SIZE(HDR_ELE(np)) == 0 && blksize >= TRIM_MIN &&
+        mem_sbrk(-(int)(blksize - TRIM_KEEP)) != (void *)-1) {
+        blksize = TRIM_KEEP;
+        np = p + blksize;
+        set_header(np, 0, HDR_ALLOC);       /* New last block */
+        hi = np;
     }
 
     /* Set current block's header and footer */
     set_header(p, blksize, HDR_FREE);
     set_footer(p, blksize);
 
-    /* Set non-merged next block's header */
-    void *const np = p + blksize;           /* Pointer to next block's header */
-    set_header(np, MM_SIZE(HDR_ELE(np)), HDR_PFREE | HDR_ALLOC);
+    /* Mark non-merged next block as "Previous free" */
+    HDR_SET_PFREE(np);
+
+    /* Keep only the node and footer of a large block in memory */
+    if (blksize >= RELEASE_MIN) {
+        if (lo < PLD_PTR(p) + 2 * WORD)
+            lo = PLD_PTR(p) + 2 * WORD;
+        if (hi > np - WORD)
+            hi = np - WORD;
+        if (lo < hi)
+            mem_release(lo, hi - lo);
+    }
 
-    return isnotmerged;
+    node_push((void **)PLD_PTR(p), blksize);
 }
 
 /*
- * get_target_block - return the pointer to head of appropriate free block while
- *       traversing the explicit free list. return NULL if there is no space.
+ * realloc_grow - Try to enlarge the allocated block at hp to blocksize
+ *      without moving it: absorb the next block if it is free, and if the
+ *      block then ends at the end of heap, extend the heap by what is
+ *      still missing. Any remainder big enough is freed. Returns 1 if the
+ *      block has grown, 0 if it has to move.
+ */
+static int realloc_grow(void *hp, size_t blocksize)
+{
+    const size_t  hele  = HDR_ELE(hp);
+    void         *nh    = hp + MM_SIZE(hele); /* Pointer to next block's header */
+    const size_t  nhele = HDR_ELE(nh);
+    size_t        avail = MM_SIZE(hele);      /* Room without moving */
+
+    if (!IS_ALLOC(nhele))
+        avail += MM_SIZE(nhele);
+    if (avail < blocksize) {
+        /* Only the end of heap can give more */
+        void *const end = hp + avail;   /* Header of the block after those */
+        if (MM_SIZE(HDR_ELE(end)) != 0 ||
+            mem_sbrk(blocksize - avail) == (void *)-1)
+            return 0;
+        set_header(hp + blocksize, 0, HDR_ALLOC); /* New last block */
+        avail = blocksize;
+    }
+    if (!IS_ALLOC(nhele))
+        node_delete((void **)PLD_PTR(nh), MM_SIZE(nhele));
+
+    if (avail - blocksize < MIN_BLK) {  /* Keep a small remainder */
+        void *const np = hp + avail;    /* Pointer to next block's header */
+        HDR_ELE(hp) = avail | MM_FLAG(hele) | HDR_RALLOC;
+        HDR_CLR_PFREE(np);
+    } else {                            /* The next block was free */
+        HDR_ELE(hp) = blocksize | MM_FLAG(hele) | HDR_RALLOC;
+        set_header(hp + blocksize, avail - blocksize, HDR_FREE);
+        set_footer(hp + blocksize, avail - blocksize);
+        node_push((void **)PLD_PTR(hp + blocksize), avail - blocksize);
+    }
+    return 1;
+}
+
+/*
+ * get_target_block - return the pointer to head of appropriate free block,
+ *       or NULL if there is no space. Blocks on the list of the request's
+ *       own size class may be too small, so that list is searched for the
+ *       best fit. Failing that, any block of a larger class fits, and
+ *       BIN_MAP tells which is the nearest non-empty one. Large requests
+ *       and requests that only the tree can serve take the best fit there.
  *
  *       Set global variable block_size as the founded block's size to specify
  *       the size of empty block after allocate.
  */
 static void *get_target_block(size_t blocksize)
 {
-    size_t   size;            /* Blocksize of each iteration. */
-    size_t   min  = -1U;      /* Minimum blocksize for entire iteration */
-    void    *dest = NULL;     /* Pointer to header of target block */
-    void   **curr = TOP;      /* Pointer to block's node of current iteration */
-    void   **prev = (void **)&TOP; /* Previous node of current ineration */
+    int       bin  = size_class(blocksize);
+    size_t    size;                 /* Blocksize of each iteration. */
+    size_t    min  = (size_t)-1;    /* Minimum blocksize for entire iteration */
+    void     *dest = NULL;          /* Pointer to header of target block */
+    void    **curr = BINS[bin];     /* Pointer to block's node of current iteration */
+    unsigned long long larger;      /* Non-empty classes above bin */
+
+    INFO.searches++;
+    if (bin == TREE_BIN)
+        return tree_fit(blocksize);
 
     while (curr != NULL) {
-        void   *hp   = HDR_PTR(curr); /* Pointer to header */
-        size_t  hele = HDR_ELE(hp); /* Header element of each block */
-
-        /**
-         * Resolve prev -> p -> *p -> (n) to prev -> *p -> (n) and move
-         * current iteration to *p. (which is real adress to block node)
-         */
-        while (hele == -1U) {
-            node_delete(prev, curr);
-            if ((curr = *curr) == NULL)
-                return dest;
-            hp   = HDR_PTR(curr);
-            hele = HDR_ELE(hp);
-        }
-        size = MM_SIZE(hele);
+        INFO.search_steps++;
+        size = MM_SIZE(HDR_ELE(HDR_PTR(curr)));
 
-        /* If the block is appropriate, load hp to dest */
+        /* If the block is appropriate, load its header to dest */
         if (size >= blocksize && size < min) {
-            dest = hp;
+            dest = HDR_PTR(curr);
             min = size;
-            prev_node = prev;
             block_size = size;    /* Load this to indicate found block's size */
+            if (size == blocksize)
+                break;            /* Can't do better than exact */
         }
 
         /* Traverse to the next list node */
-        prev = curr;
-        curr = *curr;
+        curr = NODE_NEXT(curr);
     }
+    if (dest != NULL)
+        return dest;
+
+    /* Take the first block of the nearest larger non-empty class */
+    if ((larger = BIN_MAP & (~0ULL << (bin + 1))) == 0)
+        return NULL;
+    bin = __builtin_ctzll(larger);
+    if (bin == TREE_BIN)
+        return tree_fit(blocksize);
+    dest = HDR_PTR(BINS[bin]);
+    block_size = MM_SIZE(HDR_ELE(dest));
     return dest;
 }
 
@@ -476,6 +1235,7 @@ static void *get_target_block(size_t blocksize)
  *      HDR_PFREE           free          free
  *      HDR_ALLOC         allocated     allocated
  * HDR_PFREE|HDR_ALLOC      free        allocated
+ *      HDR_MMAP            none        mapped (see mmap_malloc)
  */
 inline static void set_header(void *header, size_t blocksize, int flag)
 {
@@ -491,81 +1251,224 @@ inline static void set_footer(void *header, size_t blocksize)
 
     /* Duplicate header to footer */
     fp = (size_t *)(header + blocksize - WORD);
-    *fp = (*(size_t *)header) | FTR_VALID;
+    *fp = *(size_t *)header;
 }
 
 /*
- * node_top - Put node to the TOP of list.
+ * size_class - Return the index of the free list for blocks of blocksize.
  */
-inline static void node_top(void **node)
+inline static int size_class(size_t blocksize)
 {
-    *node = TOP;
-    TOP = node;
+    int lg, bin;
+
+    if (blocksize <= SMALL_MAX)
+        return blocksize / ALIGNMENT - 1;
+    if (blocksize >= TREE_MIN)
+        return TREE_BIN;
+
+    /* floor(log2(blocksize)), then which half of [2^lg, 2^(lg+1)) */
+    lg  = 8 * sizeof(long) - 1 - __builtin_clzl((unsigned long)blocksize);
+    bin = NSMALL + 2 * (lg - SMALL_SHIFT) + ((blocksize >> (lg - 1)) & 1);
+    return bin < NBINS ? bin : NBINS - 1;
 }
 
 /*
- * node_insert - insert node next to the prev node. prev should not be NULL.
+ * cache_class - Return the cache list for a block of blocksize: the one
+ *     of the largest class size no bigger than blocksize. Class sizes
+ *     are those of the small free lists, then two per power of two from
+ *     SMALL_MAX up, 3/2 and 2 times the one before. A list of
+ *     cache_class(blocksize - 1) + 1 then holds only blocks that fit.
  */
-inline static void node_insert(void **prev, void **node)
+inline static int cache_class(size_t blocksize)
 {
-    *node = *prev;
-    *prev = node;
+    int lg;
+
+    if (blocksize <= SMALL_MAX)
+        return blocksize / ALIGNMENT - 1;
+    lg = 8 * sizeof(long) - 1 - __builtin_clzl((unsigned long)blocksize);
+    return NSMALL - 1 + 2 * (lg - SMALL_SHIFT) + ((blocksize >> (lg - 1)) & 1);
 }
 
 /*
- * node_find_prev - Find previouse node of curr by traverse entire list. This
- *          function assume that node curr is in the list. If not, it whould
- *          not stop...
- *          If macro DEBUG is defined, in the caase that curr is not included
- *          inside of list, the program would be exited with code 1.
+ * cache_size - Return the class size of cache list cls < CACHE_NBLK,
+ *     the least size of the blocks it holds.
  */
-inline static void **node_find_prev(void **curr)
+inline static size_t cache_size(int cls)
 {
-    void **p = TOP, **prev = (void **)&TOP;
-    while (p != curr) {
-#ifdef DEBUG
-        if (p == NULL) {
-            fprintf(stderr,
-               "fatal error: attempt to search node %p but it is not on list\n"\
-               "header: %x\n", curr, *(size_t *)(curr - 1));
-            exit(1);
-        }
-#endif
-        prev = p;
-        p = *p;
+    const int m = cls - NSMALL;
+
+    if (m < 0)
+        return (cls + 1) * ALIGNMENT;
+    return m & 1 ? (size_t)SMALL_MAX << (m / 2 + 1)
+                 : (size_t)3 * SMALL_MAX << m / 2 >> 1;
+}
+
+/*
+ * node_push - Put node of a free block of blocksize to the top of the
+ *       list of its size class.
+ */
+inline static void node_push(void **node, size_t blocksize)
+{
+    const int bin = size_class(blocksize);
+
+    INFO.free_blocks++;
+    INFO.free_bytes += blocksize;
+    if (bin == TREE_BIN) {
+        tree_insert(node, blocksize);
+        return;
+    }
+    NODE_NEXT(node) = BINS[bin];
+    NODE_PREV(node) = NULL;
+    if (BINS[bin] != NULL)
+        NODE_PREV(BINS[bin]) = node;
+    BINS[bin] = node;
+    BIN_MAP |= 1ULL << bin;
+}
+
+/*
+ * node_delete - Delete node of a free block of blocksize from its list,
+ *       linking its neighbours to each other.
+ */
+inline static void node_delete(void **node, size_t blocksize)
+{
+    void **next = NODE_NEXT(node), **prev = NODE_PREV(node);
+
+    INFO.free_blocks--;
+    INFO.free_bytes -= blocksize;
+    if (blocksize >= TREE_MIN) {
+        tree_delete(node, blocksize);
+        return;
+    }
+    if (next != NULL)
+        NODE_PREV(next) = prev;
+    if (prev != NULL) {
+        NODE_NEXT(prev) = next;
+    } else {                    /* node was on top of its list */
+        const int bin = size_class(blocksize);
+
+        BINS[bin] = next;
+        if (next == NULL)
+            BIN_MAP &= ~(1ULL << bin);
     }
-    return prev;
 }
+
 /*
- * node_delete - Delete current node from explicit free list. prev should
- *  be always non-null, initialized as &TOP. (i.e. if TOP = curr, call of
- *  this function makes TOP = *curr.)
+ * tree_splay - Top-down splay of tree t around key (size, node): return
+ *       the new root, which is the node with that key if there is one,
+ *       and otherwise its predecessor or successor in the tree.
  */
-inline static void node_delete(void **prev, void **curr)
+static void **tree_splay(void **t, size_t size, void **node)
 {
-    *prev = *curr;
+    void  *hdr[2] = {NULL, NULL}; /* Collects the left and right trees */
+    void **l = (void **)hdr, **r = (void **)hdr, **y;
+
+    if (t == NULL)
+        return NULL;
+    while (1) {
+        if (node == NULL)                       /* A search, by tree_fit */
+            INFO.search_steps++;
+        if (KEY_LESS(size, node, t)) {
+            if (TREE_LEFT(t) == NULL)
+                break;
+            if (KEY_LESS(size, node, TREE_LEFT(t))) {   /* Rotate right */
+                y = TREE_LEFT(t);
+                TREE_LEFT(t) = TREE_RIGHT(y);
+                TREE_RIGHT(y) = t;
+                t = y;
+                if (TREE_LEFT(t) == NULL)
+                    break;
+            }
+            TREE_LEFT(r) = t;                           /* Link right */
+            r = t;
+            t = TREE_LEFT(t);
+        } else if (t != node) {                 /* Key is greater than t */
+            if (TREE_RIGHT(t) == NULL)
+                break;
+            if (!KEY_LESS(size, node, TREE_RIGHT(t)) &&
+                TREE_RIGHT(t) != node) {                /* Rotate left */
+                y = TREE_RIGHT(t);
+                TREE_RIGHT(t) = TREE_LEFT(y);
+                TREE_LEFT(y) = t;
+                t = y;
+                if (TREE_RIGHT(t) == NULL)
+                    break;
+            }
+            TREE_RIGHT(l) = t;                          /* Link left */
+            l = t;
+            t = TREE_RIGHT(t);
+        } else
+            break;
+    }
+    TREE_RIGHT(l) = TREE_LEFT(t);               /* Assemble */
+    TREE_LEFT(r) = TREE_RIGHT(t);
+    TREE_LEFT(t) = TREE_RIGHT(hdr);
+    TREE_RIGHT(t) = TREE_LEFT(hdr);
+    return t;
 }
 
-inline static void node_delete_s(void **curr)
+/*
+ * tree_insert - Put node of a free block of blocksize to the tree.
+ */
+static void tree_insert(void **node, size_t blocksize)
 {
-    void **prev = node_find_prev(curr);
-    node_delete(prev, curr);
+    void **t = tree_splay(BINS[TREE_BIN], blocksize, node);
+
+    if (t == NULL) {
+        TREE_LEFT(node) = TREE_RIGHT(node) = NULL;
+    } else if (KEY_LESS(blocksize, node, t)) {
+        TREE_LEFT(node) = TREE_LEFT(t);
+        TREE_RIGHT(node) = t;
+        TREE_LEFT(t) = NULL;
+    } else {
+        TREE_RIGHT(node) = TREE_RIGHT(t);
+        TREE_LEFT(node) = t;
+        TREE_RIGHT(t) = NULL;
+    }
+    BINS[TREE_BIN] = node;
+    BIN_MAP |= 1ULL << TREE_BIN;
 }
 
 /*
- * node_replace - replace list node src by dst.
+ * tree_delete - Delete node of a free block of blocksize from the tree.
+ *       Splaying the left subtree around the same key brings its maximum
+ *       to the top, which leaves it room for the right subtree.
  */
-inline static void node_replace(void **prev, void **src, void **dst)
+static void tree_delete(void **node, size_t blocksize)
 {
-    *prev = dst;
-    *dst = *src;
+    void **t = tree_splay(BINS[TREE_BIN], blocksize, node);
+
+    if (TREE_LEFT(t) == NULL) {
+        BINS[TREE_BIN] = TREE_RIGHT(t);
+    } else {
+        BINS[TREE_BIN] = tree_splay(TREE_LEFT(t), blocksize, node);
+        TREE_RIGHT(BINS[TREE_BIN]) = TREE_RIGHT(t);
+    }
+    if (BINS[TREE_BIN] == NULL)
+        BIN_MAP &= ~(1ULL << TREE_BIN);
 }
 
-inline static void node_replace_s(void **src, void **dst)
+/*
+ * tree_fit - Return the pointer to header of the smallest block on the
+ *       tree that holds blocksize, or NULL. Sets block_size like
+ *       get_target_block.
+ */
+static void *tree_fit(size_t blocksize)
 {
-    void **prev = node_find_prev(src);
-    node_replace(prev, src, dst);
+    void **t = tree_splay(BINS[TREE_BIN], blocksize, NULL);
+
+    BINS[TREE_BIN] = t;
+    if (t != NULL && NODE_SIZE(t) < blocksize) {
+        /* t is the predecessor; the successor is leftmost on its right */
+        for (t = TREE_RIGHT(t); t != NULL && TREE_LEFT(t) != NULL;
+             t = TREE_LEFT(t))
+            ;
+    }
+    if (t == NULL)
+        return NULL;
+    block_size = NODE_SIZE(t);
+    return HDR_PTR(t);
 }
+
 /*****************************
  * End of My helper routines *
  *****************************/
@@ -579,18 +1482,16 @@ static void dbg_heap_check()
 {
     void *p = FRST_BLK_HDR;
     size_t size = MM_SIZE(HDR_ELE(p));
-    void **node = TOP;
 
     while (size != 0) {
         if (!IS_ALLOC(*(size_t *)p)) {
             if (!dbg_is_on_list((void **)p + 1)) {
                 fprintf(stdout, "[%p]: (%p) %u; is not on list.\n",
-                        p, PLD_PTR(p), MM_SIZE(HDR_ELE(p));
+                        p, PLD_PTR(p), MM_SIZE(HDR_ELE(p)));
                 dbg_print_list();
                 dbg_print_heap(0);
                 exit(3);
             }
-            node = (void **)dbg_next(node);
         }
         p += size;
         size = MM_SIZE(*(size_t *)p);
@@ -604,7 +1505,15 @@ static void dbg_list_check()
 
 static int dbg_is_on_list(void **ptr)
 {
-    void **node = TOP;
+    const size_t size = NODE_SIZE(ptr);
+    void **node = BINS[size_class(size)];
+
+    if (size >= TREE_MIN) {     /* Binary search, without splaying */
+        while (node != NULL && node != ptr)
+            node = KEY_LESS(size, ptr, node) ? TREE_LEFT(node)
+                                             : TREE_RIGHT(node);
+        return node != NULL;
+    }
     while (node != NULL) {
         if (ptr == node)
             return 1;
@@ -615,15 +1524,7 @@ static int dbg_is_on_list(void **ptr)
 
 static void *dbg_next(void **ptr)
 {
-    if (ptr == NULL)
-        return (void *)-1;
-
-    void *next = *ptr;
-    if (next == NULL)
-        return NULL;
-    if (*((size_t *)next - 1) == -1)
-        return *(void **)next;
-    return next;
+    return NODE_NEXT(ptr);
 }
 
 static void dbg_print_heap(int verbose) {
@@ -646,18 +1547,22 @@ static void dbg_print_heap(int verbose) {
 static void dbg_print_list()
 {
     printf("---Free list---\n");
-    void **node = TOP;
-    printf("TOP = ");
-    while (node != NULL) {
-        printf("(%p) -> ", node);
-        if (node == dbg_next(node)) {
-            printf("<- \n");
-            exit(1);
+    for (int bin = 0; bin < TREE_BIN; bin++) {
+        void **node = BINS[bin];
+        if (node == NULL)
+            continue;
+        printf("BINS[%d] = ", bin);
+        while (node != NULL) {
+            printf("(%p) -> ", node);
+            if (node == dbg_next(node)) {
+                printf("<- \n");
+                exit(1);
+            }
+            node = dbg_next(node);
         }
-        node = dbg_next(node);
-    }
-    if (node == NULL)
         printf("NULL\n");
+    }
+    printf("TREE = (%p)\n", BINS[TREE_BIN]);
 }
 
 #endif
@@ -5,6 +5,19 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/*
+ * Free list statistics for the profiling mode of mdriver (-P). A package
+ * may leave mm_info out; mdriver then reports zeros.
+ */
+typedef struct {
+    size_t free_blocks;  /* blocks on the free lists */
+    size_t free_bytes;   /* bytes in those blocks */
+    size_t searches;     /* free list searches since mm_init */
+    size_t search_steps; /* free blocks looked at by those searches */
+} mm_info_t;
+
+extern void mm_info(mm_info_t *info);
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
@@ -0,0 +1,72 @@
+/*
+ * conn.c - Connection helpers for the event-driven echo servers
+ *     (echoservers.c, echoservere.c, echoserverr.c)
+ */
+#include <sys/resource.h>
+#include "csapp.h"
+#include "conn.h"
+
+/*
+ * raise_fd_limit - Let the process open as many descriptors as the
+ *     hard limit allows; the soft limit is usually only 1024
+ */
+void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * send_client - Send n bytes to the client, keeping whatever its socket
+ *     won't take now. Returns 0 if all were sent, 1 if some are kept,
+ *     and -1 if the connection is gone.
+ */
+int send_client(client_t *c, char *buf, int n)
+{
+    int rc;
+
+    while (n > 0) {
+	if ((rc = write(c->fd, buf, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return -1;
+	    c->out = Malloc(MAXLINE);   /* n <= MAXLINE: one line at most */
+	    memcpy(c->out, buf, n);
+	    c->outpos = 0;
+	    c->outlen = n;
+	    return 1;
+	}
+	buf += rc;
+	n -= rc;
+    }
+    return 0;
+}
+
+/*
+ * flush_client - Send the bytes send_client kept. Returns 0 once there
+ *     are none left, 1 if some still are, and -1 if the connection is
+ *     gone.
+ */
+int flush_client(client_t *c)
+{
+    int rc;
+
+    while (c->out != NULL) {
+	if ((rc = write(c->fd, c->out + c->outpos,
+			c->outlen - c->outpos)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+	}
+	if ((c->outpos += rc) == c->outlen) {
+	    Free(c->out);
+	    c->out = NULL;
+	}
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "csapp.h"
+
+/*
+ * Per-connection state shared by the event-driven echo servers. Writes
+ * never wait: bytes a slow reader's socket won't take are kept in out
+ * until the descriptor is writable again.
+ */
+typedef struct {
+    int fd;       /* Connected descriptor, in O_NONBLOCK mode */
+    rio_t *rio;   /* Read buffer; the epoll servers attach it on demand */
+    char *out;    /* Unsent bytes, NULL while there are none */
+    int outpos;   /* Next unsent byte in out */
+    int outlen;   /* End of the unsent bytes in out */
+} client_t;
+
+void raise_fd_limit(void);
+int send_client(client_t *c, char *buf, int n);
+int flush_client(client_t *c);
+
+#endif /* __CONN_H__ */
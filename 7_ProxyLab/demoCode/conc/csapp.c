@@ -755,6 +755,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
     memcpy(usrbuf, rp->rio_bufptr, cnt);
     rp->rio_bufptr += cnt;
     rp->rio_cnt -= cnt;
+    rp->rio_scan = 0;
     return cnt;
 }
 /* $end rio_read */
@@ -767,6 +768,7 @@ void rio_readinitb(rio_t *rp, int fd) {
     rp->rio_fd = fd;
     rp->rio_cnt = 0;
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_scan = 0;
 }
 /* $end rio_readinitb */
 
@@ -821,6 +823,110 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
 }
 /* $end rio_readlineb */
 
+/*
+ * Non-blocking Rio, for select/epoll servers
+ *
+ * rio_readnb_nb and rio_readlineb_nb work like rio_readnb and
+ * rio_readlineb on a descriptor in O_NONBLOCK mode. When a whole line
+ * (or all n bytes) is not available yet they return -1 with errno set
+ * to EAGAIN, and the bytes received so far stay in the rio_t's internal
+ * buffer, so the caller simply calls again once the descriptor becomes
+ * readable. Lines that are already buffered are returned without a
+ * read(), and select/epoll can't see them, so a caller should keep
+ * reading until EAGAIN before it waits again.
+ */
+
+/*
+ * rio_nbfill - Move the unread bytes to the front of the internal buffer
+ *    and read() more behind them. Returns the number of bytes read, 0 on
+ *    EOF, and -1 with errno EAGAIN if none are available right now.
+ */
+static ssize_t rio_nbfill(rio_t *rp) {
+    ssize_t rc;
+
+    if (rp->rio_cnt < 0) /* Left over from a failed rio_read */
+        rp->rio_cnt = 0;
+    if (rp->rio_bufptr != rp->rio_buf) {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    while ((rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                      sizeof(rp->rio_buf) - rp->rio_cnt)) < 0) {
+        if (errno == EWOULDBLOCK)
+            errno = EAGAIN;
+        if (errno != EINTR) /* Interrupted by sig handler return */
+            return -1;
+    }
+    rp->rio_cnt += rc;
+    return rc;
+}
+
+/*
+ * rio_readnb_nb - Read n bytes, n <= RIO_BUFSIZE (buffered, non-blocking)
+ */
+ssize_t rio_readnb_nb(rio_t *rp, void *usrbuf, size_t n) {
+    ssize_t rc;
+    size_t cnt;
+
+    if (n > sizeof(rp->rio_buf)) {
+        errno = EINVAL; /* The whole record must fit in the buffer */
+        return -1;
+    }
+    while ((cnt = rp->rio_cnt > 0 ? rp->rio_cnt : 0) < n) {
+        if ((rc = rio_nbfill(rp)) < 0)
+            return -1; /* EAGAIN: call again when readable */
+        else if (rc == 0) {
+            n = cnt;   /* EOF, return what is left */
+            break;
+        }
+    }
+    memcpy(usrbuf, rp->rio_bufptr, n);
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    rp->rio_scan = 0;
+    return n;
+}
+
+/*
+ * rio_readlineb_nb - Read a text line (buffered, non-blocking)
+ *    rio_scan remembers how much of an unfinished line has been searched
+ *    already, so a long line arriving in small pieces is scanned once.
+ */
+ssize_t rio_readlineb_nb(rio_t *rp, void *usrbuf, size_t maxlen) {
+    ssize_t rc;
+    size_t cnt, scan, lim = maxlen > 0 ? maxlen - 1 : 0;
+    char *nl, *bufp = usrbuf;
+
+    for (;;) {
+        cnt = rp->rio_cnt > 0 ? rp->rio_cnt : 0;
+        if (cnt > lim)
+            cnt = lim;
+        scan = (size_t)rp->rio_scan < cnt ? rp->rio_scan : cnt;
+        if ((nl = memchr(rp->rio_bufptr + scan, '\n', cnt - scan)) != NULL) {
+            cnt = nl - rp->rio_bufptr + 1; /* A whole line */
+            break;
+        }
+        rp->rio_scan = cnt;
+        if (cnt == lim || cnt == sizeof(rp->rio_buf))
+            break; /* Longer than maxlen or the buffer: return a piece */
+        if ((rc = rio_nbfill(rp)) < 0)
+            return -1; /* EAGAIN: call again when readable */
+        else if (rc == 0) {
+            if (cnt == 0)
+                return 0; /* EOF, no data read */
+            else
+                break; /* EOF, some data was read */
+        }
+    }
+    memcpy(bufp, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    rp->rio_scan = 0;
+    if (maxlen > 0)
+        bufp[cnt] = 0;
+    return cnt;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -857,6 +963,23 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
     return rc;
 }
 
+/* The non-blocking wrappers return -1 only for EAGAIN */
+ssize_t Rio_readnb_nb(rio_t *rp, void *usrbuf, size_t n) {
+    ssize_t rc;
+
+    if ((rc = rio_readnb_nb(rp, usrbuf, n)) < 0 && errno != EAGAIN)
+        unix_error("Rio_readnb_nb error");
+    return rc;
+}
+
+ssize_t Rio_readlineb_nb(rio_t *rp, void *usrbuf, size_t maxlen) {
+    ssize_t rc;
+
+    if ((rc = rio_readlineb_nb(rp, usrbuf, maxlen)) < 0 && errno != EAGAIN)
+        unix_error("Rio_readlineb_nb error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
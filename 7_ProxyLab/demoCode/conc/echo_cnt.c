@@ -1,17 +1,19 @@
 /* 
  * A thread-safe version of echo that counts the total number
- * of bytes received from clients.
+ * of bytes received from clients. Each worker adds into its own
+ * shard of the counter and a reporter thread prints the total
+ * once a second, so workers never wait on each other.
  */
 /* $begin echo_cnt */
 #include "csapp.h"
+#include "scnt.h"
 
-static int byte_cnt;  /* Byte counter */
-static sem_t mutex;   /* and the mutex that protects it */
+static scnt_t byte_cnt; /* Byte counter, sharded per thread */
 
 static void init_echo_cnt(void)
 {
-    Sem_init(&mutex, 0, 1);
-    byte_cnt = 0;
+    scnt_init(&byte_cnt);
+    scnt_report(&byte_cnt, "server received bytes", 1);
 }
 
 void echo_cnt(int connfd) 
@@ -24,11 +26,7 @@ void echo_cnt(int connfd)
     Pthread_once(&once, init_echo_cnt); //line:conc:pre:pthreadonce
     Rio_readinitb(&rio, connfd);        //line:conc:pre:rioinitb
     while((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {
-	P(&mutex);
-	byte_cnt += n; //line:conc:pre:cntaccess1
-	printf("server received %d (%d total) bytes on fd %d\n", 
-	       n, byte_cnt, connfd); //line:conc:pre:cntaccess2
-	V(&mutex);
+	scnt_add(&byte_cnt, n); //line:conc:pre:cntaccess1
 	Rio_writen(connfd, buf, n);
     }
 }
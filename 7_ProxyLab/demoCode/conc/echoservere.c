@@ -0,0 +1,164 @@
+/*
+ * echoservere.c - A concurrent echo server based on edge-triggered epoll
+ *     Unlike echoservers.c there is no FD_SETSIZE array to scan: each
+ *     event carries a pointer to its connection's state, which is
+ *     allocated on accept. The read buffer is attached only while a
+ *     connection is being read or holds an unfinished line, so a mostly
+ *     idle connection costs a few bytes plus its kernel socket.
+ *
+ *     Writes never wait: what a slow reader's socket won't take is kept
+ *     in an output buffer, and the connection is not read again until
+ *     EPOLLOUT has let the buffer drain. A client that goes away only
+ *     closes its own connection.
+ */
+#include "csapp.h"
+#include "conn.h"
+#include <sys/epoll.h>
+
+#define MAXEVENTS 1024  /* Events taken per epoll_wait */
+
+void accept_clients(int epfd, int listenfd);
+void check_client(client_t *c);
+void close_client(client_t *c);
+
+int byte_cnt = 0; /* Counts total bytes received by server */
+static rio_t *spare_rio = NULL; /* One cached buffer saves a malloc per event */
+
+int main(int argc, char **argv)
+{
+    int listenfd, epfd, i, n;
+    struct epoll_event ev, *events;
+
+    if (argc != 2) {
+	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+	exit(0);
+    }
+    raise_fd_limit();
+    Signal(SIGPIPE, SIG_IGN);   /* A reset connection fails with EPIPE */
+    listenfd = Open_listenfd(argv[1]);
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+
+    if ((epfd = epoll_create1(0)) < 0)
+	unix_error("epoll_create1 error");
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;           /* NULL marks the listening descriptor */
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	unix_error("epoll_ctl error");
+    events = Malloc(MAXEVENTS * sizeof(struct epoll_event));
+
+    while (1) {
+	if ((n = epoll_wait(epfd, events, MAXEVENTS, -1)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("epoll_wait error");
+	}
+	for (i = 0; i < n; i++) {
+	    if (events[i].data.ptr == NULL)
+		accept_clients(epfd, listenfd);
+	    else
+		check_client(events[i].data.ptr);
+	}
+    }
+}
+
+/*
+ * accept_clients - Accept every pending connection. The listening
+ *     descriptor is edge-triggered, so stop only on EAGAIN.
+ */
+void accept_clients(int epfd, int listenfd)
+{
+    int connfd;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    struct epoll_event ev;
+    client_t *c;
+
+    while (1) {
+	clientlen = sizeof(struct sockaddr_storage);
+	if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		fprintf(stderr, "accept error: %s\n", strerror(errno));
+	    return;
+	}
+	fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+
+	c = Malloc(sizeof(client_t));
+	c->fd = connfd;
+	c->rio = NULL;
+	c->out = NULL;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+	    unix_error("epoll_ctl error");
+    }
+}
+
+/*
+ * check_client - Send what is left of the output, then echo every
+ *     complete line the client has sent. The descriptor is
+ *     edge-triggered, so read until EAGAIN, or until a line could not
+ *     be sent in full; an unfinished line keeps its buffer until the
+ *     next event.
+ */
+void check_client(client_t *c)
+{
+    int n, rc;
+    char buf[MAXLINE];
+
+    if ((rc = flush_client(c)) != 0) {
+	if (rc < 0)
+	    close_client(c);
+	return;         /* Wait for EPOLLOUT before reading on */
+    }
+    if (c->rio == NULL) {
+	if (spare_rio) {
+	    c->rio = spare_rio;
+	    spare_rio = NULL;
+	}
+	else
+	    c->rio = Malloc(sizeof(rio_t));
+	Rio_readinitb(c->rio, c->fd);
+    }
+
+    while ((n = rio_readlineb_nb(c->rio, buf, MAXLINE)) > 0) {
+	byte_cnt += n;
+	printf("Server received %d (%d total) bytes on fd %d\n",
+	       n, byte_cnt, c->fd);
+	if ((rc = send_client(c, buf, n)) != 0) {
+	    if (rc < 0)
+		n = 0;  /* Client went away: treat it as EOF */
+	    break;
+	}
+    }
+    if (n < 0 && errno != EAGAIN)
+	n = 0;          /* Reset by peer and the like */
+
+    /* Hand the buffer back unless it holds part of a line */
+    if (n == 0 || c->rio->rio_cnt <= 0) {
+	if (spare_rio == NULL)
+	    spare_rio = c->rio;
+	else
+	    Free(c->rio);
+	c->rio = NULL;
+    }
+    if (n == 0)
+	close_client(c);
+}
+
+/*
+ * close_client - Close the connection; this also drops it from epoll
+ */
+void close_client(client_t *c)
+{
+    if (c->rio != NULL) {
+	if (spare_rio == NULL)
+	    spare_rio = c->rio;
+	else
+	    Free(c->rio);
+    }
+    Free(c->out);
+    Close(c->fd);
+    Free(c);
+}
@@ -0,0 +1,218 @@
+/*
+ * echoserverr.c - A concurrent echo server with one epoll reactor per core
+ *     The main thread only accepts. It gives each connection to the
+ *     reactor with the fewest open connections by adding the descriptor
+ *     straight to that reactor's epoll set. From then on the connection
+ *     is touched only by its reactor thread, so the data path shares no
+ *     locks and no writable memory with the other reactors.
+ *
+ *     As in echoservere.c, a slow reader's unsent bytes wait in an
+ *     output buffer for EPOLLOUT instead of stalling the reactor, and a
+ *     failed accept() or a dead client never takes the server down.
+ */
+#include "csapp.h"
+#include "conn.h"
+#include "scnt.h"
+#include <sys/epoll.h>
+#include <limits.h>
+
+#define MAXEVENTS 1024  /* Events taken per epoll_wait */
+#define MAXREACTORS 64
+#define BACKOFF   100000    /* Microseconds to pause after accept fails */
+#define CACHELINE 64
+
+typedef struct {        /* One event loop and the connections it owns */
+    int id;
+    int epfd;           /* This reactor's own epoll instance */
+    rio_t *spare_rio;   /* One cached buffer saves a malloc per event */
+
+    /* The acceptor writes this too, so it gets a line of its own */
+    int nconns __attribute__((aligned(CACHELINE)));
+                        /* Open connections */
+} __attribute__((aligned(CACHELINE))) reactor_t; /* No false sharing */
+
+reactor_t *pick_reactor(void);
+void *reactor(void *vargp);
+void check_client(reactor_t *r, client_t *c);
+void close_client(reactor_t *r, client_t *c);
+
+static reactor_t reactors[MAXREACTORS];
+static int nreactors;
+static scnt_t byte_cnt; /* Bytes echoed, one shard per reactor */
+
+int main(int argc, char **argv)
+{
+    int i, listenfd, connfd;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    struct epoll_event ev;
+    reactor_t *r;
+    client_t *c;
+    pthread_t tid;
+
+    if (argc != 2 && argc != 3) {
+	fprintf(stderr, "usage: %s <port> [nreactors]\n", argv[0]);
+	exit(0);
+    }
+    nreactors = (argc == 3) ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nreactors < 1)
+	nreactors = 1;
+    if (nreactors > MAXREACTORS)
+	nreactors = MAXREACTORS;
+
+    raise_fd_limit();
+    Signal(SIGPIPE, SIG_IGN);
+    scnt_init(&byte_cnt);
+    scnt_report(&byte_cnt, "server echoed bytes", 1);
+    for (i = 0; i < nreactors; i++) {
+	reactors[i].id = i;
+	if ((reactors[i].epfd = epoll_create1(0)) < 0)
+	    unix_error("epoll_create1 error");
+	Pthread_create(&tid, NULL, reactor, &reactors[i]);
+    }
+
+    listenfd = Open_listenfd(argv[1]);
+    while (1) {
+	clientlen = sizeof(struct sockaddr_storage);
+	if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    /* Most likely EMFILE/ENFILE: give the reactors time to
+	       close some connections instead of failing in a loop */
+	    fprintf(stderr, "accept error: %s\n", strerror(errno));
+	    usleep(BACKOFF);
+	    continue;
+	}
+	fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+
+	/* epoll_ctl is safe across threads, so handing off needs no lock */
+	r = pick_reactor();
+	c = Malloc(sizeof(client_t));
+	c->fd = connfd;
+	c->rio = NULL;
+	c->out = NULL;
+	__atomic_add_fetch(&r->nconns, 1, __ATOMIC_RELAXED);
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+	    fprintf(stderr, "epoll_ctl error: %s\n", strerror(errno));
+	    __atomic_sub_fetch(&r->nconns, 1, __ATOMIC_RELAXED);
+	    Free(c);
+	    Close(connfd);
+	}
+    }
+}
+
+/*
+ * pick_reactor - Return the reactor with the fewest open connections.
+ *     The scan starts after the last pick, so ties go round-robin.
+ */
+reactor_t *pick_reactor(void)
+{
+    static int next = 0;
+    int i, k, n, best = next, min = INT_MAX;
+
+    for (i = 0; i < nreactors; i++) {
+	k = (next + i) % nreactors;
+	n = __atomic_load_n(&reactors[k].nconns, __ATOMIC_RELAXED);
+	if (n < min) {
+	    min = n;
+	    best = k;
+	}
+    }
+    next = (best + 1) % nreactors;
+    return &reactors[best];
+}
+
+/*
+ * reactor - Thread routine: run one event loop over the connections
+ *     the acceptor has given this reactor
+ */
+void *reactor(void *vargp)
+{
+    reactor_t *r = vargp;
+    struct epoll_event *events;
+    int i, n;
+
+    Pthread_detach(pthread_self());
+    events = Malloc(MAXEVENTS * sizeof(struct epoll_event));
+    while (1) {
+	if ((n = epoll_wait(r->epfd, events, MAXEVENTS, -1)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("epoll_wait error");
+	}
+	for (i = 0; i < n; i++)
+	    check_client(r, events[i].data.ptr);
+    }
+    return NULL;
+}
+
+/*
+ * check_client - Send what is left of the output, then echo every
+ *     complete line the client has sent. The descriptor is
+ *     edge-triggered, so read until EAGAIN, or until a line could not
+ *     be sent in full; an unfinished line keeps its buffer until the
+ *     next event.
+ */
+void check_client(reactor_t *r, client_t *c)
+{
+    int n, rc;
+    char buf[MAXLINE];
+
+    if ((rc = flush_client(c)) != 0) {
+	if (rc < 0)
+	    close_client(r, c);
+	return;         /* Wait for EPOLLOUT before reading on */
+    }
+    if (c->rio == NULL) {
+	if (r->spare_rio) {
+	    c->rio = r->spare_rio;
+	    r->spare_rio = NULL;
+	}
+	else
+	    c->rio = Malloc(sizeof(rio_t));
+	Rio_readinitb(c->rio, c->fd);
+    }
+
+    while ((n = rio_readlineb_nb(c->rio, buf, MAXLINE)) > 0) {
+	scnt_add(&byte_cnt, n);
+	if ((rc = send_client(c, buf, n)) != 0) {
+	    if (rc < 0)
+		n = 0;  /* Client went away: treat it as EOF */
+	    break;
+	}
+    }
+    if (n < 0 && errno != EAGAIN)
+	n = 0;          /* Reset by peer and the like */
+
+    /* Hand the buffer back unless it holds part of a line */
+    if (n == 0 || c->rio->rio_cnt <= 0) {
+	if (r->spare_rio == NULL)
+	    r->spare_rio = c->rio;
+	else
+	    Free(c->rio);
+	c->rio = NULL;
+    }
+
+    if (n == 0)
+	close_client(r, c);
+}
+
+/*
+ * close_client - Close the connection; this also drops it from the
+ *     epoll set
+ */
+void close_client(reactor_t *r, client_t *c)
+{
+    if (c->rio != NULL) {
+	if (r->spare_rio == NULL)
+	    r->spare_rio = c->rio;
+	else
+	    Free(c->rio);
+    }
+    Free(c->out);
+    Close(c->fd);
+    Free(c);
+    __atomic_sub_fetch(&r->nconns, 1, __ATOMIC_RELAXED);
+}
@@ -1,22 +1,33 @@
 /* 
  * echoservers.c - A concurrent echo server based on select
+ *     Connected descriptors are non-blocking and read with the
+ *     non-blocking Rio, so a client that sends half a line can't
+ *     stall the others. Nor can one that stops reading: what its
+ *     socket won't take waits in the client's output buffer, and the
+ *     descriptor moves from the read set to the write set until the
+ *     buffer has drained.
  */
 /* $begin echoserversmain */
 #include "csapp.h"
+#include "conn.h"
 
 typedef struct { /* Represents a pool of connected descriptors */ //line:conc:echoservers:beginpool
     int maxfd;        /* Largest descriptor in read_set */   
     fd_set read_set;  /* Set of all active descriptors */
+    fd_set write_set; /* Descriptors with output waiting to be sent */
     fd_set ready_set; /* Subset of descriptors ready for reading  */
+    fd_set ready_wset; /* Subset of write_set ready for writing */
     int nready;       /* Number of ready descriptors from select */   
     int maxi;         /* Highwater index into client array */
     int clientfd[FD_SETSIZE];    /* Set of active descriptors */
     rio_t clientrio[FD_SETSIZE]; /* Set of active read buffers */
+    client_t client[FD_SETSIZE]; /* Output buffers, see conn.h */
 } pool; //line:conc:echoservers:endpool
 /* $end echoserversmain */
 void init_pool(int listenfd, pool *p);
 void add_client(int connfd, pool *p);
 void check_clients(pool *p);
+void remove_client(int i, pool *p);
 /* $begin echoserversmain */
 
 int byte_cnt = 0; /* Counts total bytes received by server */
@@ -32,13 +43,16 @@ int main(int argc, char **argv)
 	fprintf(stderr, "usage: %s <port>\n", argv[0]);
 	exit(0);
     }
+    Signal(SIGPIPE, SIG_IGN);   /* A reset connection fails with EPIPE */
     listenfd = Open_listenfd(argv[1]);
     init_pool(listenfd, &pool); //line:conc:echoservers:initpool
 
     while (1) {
 	/* Wait for listening/connected descriptor(s) to become ready */
 	pool.ready_set = pool.read_set;
-	pool.nready = Select(pool.maxfd+1, &pool.ready_set, NULL, NULL, NULL);
+	pool.ready_wset = pool.write_set;
+	pool.nready = Select(pool.maxfd+1, &pool.ready_set, &pool.ready_wset,
+			     NULL, NULL);
 
 	/* If listening descriptor ready, add new client to pool */
 	if (FD_ISSET(listenfd, &pool.ready_set)) { //line:conc:echoservers:listenfdready
@@ -47,7 +61,7 @@ int main(int argc, char **argv)
 	    add_client(connfd, &pool); //line:conc:echoservers:addclient
 	}
 	
-	/* Echo a text line from each ready connected descriptor */ 
+	/* Echo the text lines of each ready connected descriptor */ 
 	check_clients(&pool); //line:conc:echoservers:checkclients
     }
 }
@@ -65,6 +79,7 @@ void init_pool(int listenfd, pool *p)
     /* Initially, listenfd is only member of select read set */
     p->maxfd = listenfd;            //line:conc:echoservers:begininit
     FD_ZERO(&p->read_set);
+    FD_ZERO(&p->write_set);
     FD_SET(listenfd, &p->read_set); //line:conc:echoservers:endinit
 }
 /* $end init_pool */
@@ -79,6 +94,10 @@ void add_client(int connfd, pool *p)
 	    /* Add connected descriptor to the pool */
 	    p->clientfd[i] = connfd;                 //line:conc:echoservers:beginaddclient
 	    Rio_readinitb(&p->clientrio[i], connfd); //line:conc:echoservers:endaddclient
+	    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+	    p->client[i].fd = connfd;
+	    p->client[i].rio = &p->clientrio[i];
+	    p->client[i].out = NULL;
 
 	    /* Add the descriptor to descriptor set */
 	    FD_SET(connfd, &p->read_set); //line:conc:echoservers:addconnfd
@@ -98,32 +117,72 @@ void add_client(int connfd, pool *p)
 /* $begin check_clients */
 void check_clients(pool *p) 
 {
-    int i, connfd, n;
+    int i, connfd, n, rc, rready, wready;
     char buf[MAXLINE]; 
-    rio_t rio;
+    client_t *c;
 
     for (i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
 	connfd = p->clientfd[i];
-	rio = p->clientrio[i];
-
-	/* If the descriptor is ready, echo a text line from it */
-	if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set))) { 
-	    p->nready--;
-	    if ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {
-		byte_cnt += n; //line:conc:echoservers:beginecho
-		printf("Server received %d (%d total) bytes on fd %d\n", 
-		       n, byte_cnt, connfd);
-		Rio_writen(connfd, buf, n); //line:conc:echoservers:endecho
+	c = &p->client[i];
+	if (connfd < 0)
+	    continue;
+	rready = FD_ISSET(connfd, &p->ready_set) != 0;
+	wready = FD_ISSET(connfd, &p->ready_wset) != 0;
+	if (!rready && !wready)
+	    continue;
+	p->nready -= rready + wready;
+
+	/* Send what a full socket left over; the descriptor goes back
+	   to the read set only once all of it is gone */
+	if (wready) {
+	    if ((rc = flush_client(c)) < 0) {
+		remove_client(i, p);
+		continue;
 	    }
+	    if (rc > 0)
+		continue;
+	    FD_CLR(connfd, &p->write_set);
+	    FD_SET(connfd, &p->read_set);
+	}
 
-	    /* EOF detected, remove descriptor from pool */
-	    else { 
-		Close(connfd); //line:conc:echoservers:closeconnfd
-		FD_CLR(connfd, &p->read_set); //line:conc:echoservers:beginremove
-		p->clientfd[i] = -1;          //line:conc:echoservers:endremove
+	/* Echo the text lines the client has sent, including any still
+	   buffered from before its socket filled up; an unfinished line
+	   stays buffered in rio until the next time */
+	while ((n = rio_readlineb_nb(c->rio, buf, MAXLINE)) > 0) {
+	    byte_cnt += n; //line:conc:echoservers:beginecho
+	    printf("Server received %d (%d total) bytes on fd %d\n", 
+		   n, byte_cnt, connfd);
+	    if ((rc = send_client(c, buf, n)) != 0) { //line:conc:echoservers:endecho
+		if (rc < 0) {
+		    n = 0;      /* Client went away: treat it as EOF */
+		    break;
+		}
+		FD_CLR(connfd, &p->read_set);   /* Wait until it drains */
+		FD_SET(connfd, &p->write_set);
+		break;
 	    }
 	}
+	if (n < 0 && errno != EAGAIN)
+	    n = 0;              /* Reset by peer and the like */
+
+	/* EOF detected, remove descriptor from pool */
+	if (n == 0)
+	    remove_client(i, p);
     }
 }
 /* $end check_clients */
 
+/*
+ * remove_client - Close slot i's connection and drop it from the pool
+ */
+void remove_client(int i, pool *p)
+{
+    int connfd = p->clientfd[i];
+
+    Close(connfd); //line:conc:echoservers:closeconnfd
+    FD_CLR(connfd, &p->read_set); //line:conc:echoservers:beginremove
+    FD_CLR(connfd, &p->write_set);
+    Free(p->client[i].out);
+    p->client[i].out = NULL;
+    p->clientfd[i] = -1;          //line:conc:echoservers:endremove
+}
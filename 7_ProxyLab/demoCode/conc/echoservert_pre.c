@@ -1,11 +1,20 @@
 /* 
  * echoservert_pre.c - A prethreaded concurrent echo server
+ *     The main thread drains every pending connection each time the
+ *     listening descriptor becomes readable and hands them to the
+ *     workers with a single batched insert. If accept fails for any
+ *     other reason than an empty backlog, such as running out of
+ *     descriptors, the error is reported and the main thread pauses, as
+ *     the listening descriptor would stay readable and poll would spin.
  */
 /* $begin echoservertpremain */
 #include "csapp.h"
 #include "sbuf.h"
+#include <poll.h>
 #define NTHREADS  4
 #define SBUFSIZE  16
+#define NACCEPT   SBUFSIZE  /* Most connections taken per wakeup */
+#define BACKOFF   100000    /* Microseconds to pause after accept fails */
 
 void echo_cnt(int connfd);
 void *thread(void *vargp);
@@ -14,9 +23,10 @@ sbuf_t sbuf; /* Shared buffer of connected descriptors */
 
 int main(int argc, char **argv) 
 {
-    int i, listenfd, connfd;
+    int i, n, failed, listenfd, connfd, connfds[NACCEPT];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    struct pollfd pfd;
     pthread_t tid; 
 
     if (argc != 2) {
@@ -24,15 +34,34 @@ int main(int argc, char **argv)
 	exit(0);
     }
     listenfd = Open_listenfd(argv[1]);
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+    pfd.fd = listenfd;
+    pfd.events = POLLIN;
 
     sbuf_init(&sbuf, SBUFSIZE); //line:conc:pre:initsbuf
     for (i = 0; i < NTHREADS; i++)  /* Create worker threads */ //line:conc:pre:begincreate
 	Pthread_create(&tid, NULL, thread, NULL);               //line:conc:pre:endcreate
 
     while (1) { 
-        clientlen = sizeof(struct sockaddr_storage);
-	connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-	sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+	    unix_error("poll error");
+	for (n = 0, failed = 0; n < NACCEPT; ) {
+	    clientlen = sizeof(struct sockaddr_storage);
+	    if ((connfd = accept(listenfd, (SA *) &clientaddr, &clientlen)) >= 0) {
+		connfds[n++] = connfd;
+		continue;
+	    }
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		fprintf(stderr, "accept error: %s\n", strerror(errno));
+		failed = 1;
+	    }
+	    break;              /* EAGAIN: the backlog is empty */
+	}
+	sbuf_insert_batch(&sbuf, connfds, n); /* Insert them in buffer */
+	if (failed)             /* Give the workers time to close some */
+	    usleep(BACKOFF);
     }
 }
 
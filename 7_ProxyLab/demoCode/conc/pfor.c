@@ -0,0 +1,249 @@
+/*
+ * pfor.c - Parallel for and reduce over a persistent work-stealing pool.
+ *     A job is an index range. Each worker keeps a deque of ranges; it
+ *     splits the range it is working on in half until it is no bigger
+ *     than the grain, pushing the upper halves on its own deque, and
+ *     pops the most recent half when it runs out. An idle worker steals
+ *     the oldest, and so biggest, range from a random victim. Chunk
+ *     sizes therefore adapt to the load instead of being fixed up front.
+ *
+ *     The calling thread takes part as worker 0. A pool runs one job at
+ *     a time, and a body must not start another job on the same pool.
+ */
+#include "csapp.h"
+#include "pfor.h"
+
+#define PFOR_MASK (PFOR_DEQUESIZE - 1)
+
+/* Push range [lo, hi) on the bottom of w's deque */
+static void pfor_push(pfor_worker_t *w, long lo, long hi)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom - w->top == PFOR_DEQUESIZE)
+        app_error("pfor_push error: deque overflow");
+    w->task[w->bottom & PFOR_MASK].lo = lo;
+    w->task[w->bottom & PFOR_MASK].hi = hi;
+    w->bottom++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Pop the newest range off w's deque into *rp; return 0 if it is empty */
+static int pfor_pop(pfor_worker_t *w, pfor_range_t *rp)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom != w->top) {
+        *rp = w->task[--w->bottom & PFOR_MASK];
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+/* Take the oldest range of some other worker into *rp; 0 if none has any */
+static int pfor_steal(pfor_pool_t *pp, pfor_worker_t *me, pfor_range_t *rp)
+{
+    int i, start, found = 0;
+    pfor_worker_t *v;
+
+    start = rand_r(&me->seed) % pp->nworkers;
+    for (i = 0; !found && i < pp->nworkers; i++) {
+        v = &pp->w[(start + i) % pp->nworkers];
+        if (v == me || __atomic_load_n(&v->bottom, __ATOMIC_RELAXED) ==
+                       __atomic_load_n(&v->top, __ATOMIC_RELAXED))
+            continue;           /* Looks empty; don't bother locking */
+        pthread_mutex_lock(&v->lock);
+        if (v->bottom != v->top) {
+            *rp = v->task[v->top++ & PFOR_MASK];
+            found = 1;
+        }
+        pthread_mutex_unlock(&v->lock);
+    }
+    return found;
+}
+
+/* Work on the current job until every index of it has been processed */
+static void pfor_work(pfor_pool_t *pp, pfor_worker_t *me)
+{
+    pfor_range_t r;
+    long mid;
+
+    while (__atomic_load_n(&pp->remaining, __ATOMIC_ACQUIRE) > 0) {
+        if (!pfor_pop(me, &r) && !pfor_steal(pp, me, &r)) {
+            sched_yield();      /* The last ranges are being run */
+            continue;
+        }
+        while (r.hi - r.lo > pp->grain) {   /* Leave halves to thieves */
+            mid = r.lo + (r.hi - r.lo) / 2;
+            pfor_push(me, mid, r.hi);
+            r.hi = mid;
+        }
+        me->acc = pp->combine(me->acc, pp->body(r.lo, r.hi, pp->arg));
+        __atomic_sub_fetch(&pp->remaining, r.hi - r.lo, __ATOMIC_RELEASE);
+    }
+}
+
+/* Thread routine for the helpers: join every job that is posted */
+static void *pfor_thread(void *vargp)
+{
+    pfor_worker_t *me = vargp;
+    pfor_pool_t *pp = me->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pp->lock);
+    while (1) {
+        while (pp->gen == seen && !pp->quit)
+            pthread_cond_wait(&pp->start, &pp->lock);
+        if (pp->quit)
+            break;
+        seen = pp->gen;
+        if (!pp->running)       /* Woke up after the job was over */
+            continue;
+        pp->active++;
+        pthread_mutex_unlock(&pp->lock);
+
+        pfor_work(pp, me);
+
+        pthread_mutex_lock(&pp->lock);
+        if (--pp->active == 0)
+            pthread_cond_signal(&pp->done);
+    }
+    pthread_mutex_unlock(&pp->lock);
+    return NULL;
+}
+
+/*
+ * pfor_create - Create a pool of nworkers workers, the caller included;
+ *     nworkers <= 0 means one per online CPU
+ */
+pfor_pool_t *pfor_create(int nworkers)
+{
+    int i;
+    pfor_pool_t *pp = Calloc(1, sizeof(pfor_pool_t));
+
+    if (nworkers <= 0)
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers > PFOR_MAXWORKERS)
+        nworkers = PFOR_MAXWORKERS;
+    if (nworkers < 1)
+        nworkers = 1;
+    pp->nworkers = nworkers;
+    if (posix_memalign((void **)&pp->w, PFOR_CACHELINE,
+                       nworkers * sizeof(pfor_worker_t)) != 0)
+        app_error("pfor_create error: out of memory");
+    memset(pp->w, 0, nworkers * sizeof(pfor_worker_t));
+    pp->tid = Calloc(nworkers, sizeof(pthread_t));
+    pthread_mutex_init(&pp->lock, NULL);
+    pthread_cond_init(&pp->start, NULL);
+    pthread_cond_init(&pp->done, NULL);
+
+    for (i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&pp->w[i].lock, NULL);
+        pp->w[i].id = i;
+        pp->w[i].seed = i + 1;
+        pp->w[i].pool = pp;
+        if (i > 0)
+            Pthread_create(&pp->tid[i], NULL, pfor_thread, &pp->w[i]);
+    }
+    return pp;
+}
+
+/* Stop the helpers and free pool pp */
+void pfor_destroy(pfor_pool_t *pp)
+{
+    int i;
+
+    pthread_mutex_lock(&pp->lock);
+    pp->quit = 1;
+    pthread_cond_broadcast(&pp->start);
+    pthread_mutex_unlock(&pp->lock);
+    for (i = 1; i < pp->nworkers; i++)
+        Pthread_join(pp->tid[i], NULL);
+    for (i = 0; i < pp->nworkers; i++)
+        pthread_mutex_destroy(&pp->w[i].lock);
+    pthread_cond_destroy(&pp->done);
+    pthread_cond_destroy(&pp->start);
+    pthread_mutex_destroy(&pp->lock);
+    Free(pp->tid);
+    Free(pp->w);
+    Free(pp);
+}
+
+/*
+ * pfor_reduce - Return the combination of body(lo', hi', arg) over a
+ *     partition of [lo, hi) into ranges of at most grain indices, or of
+ *     about 1/32 of each worker's share if grain <= 0. combine must be
+ *     associative and commutative, with identity as its identity.
+ */
+long pfor_reduce(pfor_pool_t *pp, long lo, long hi, long grain,
+                 pfor_body_t body, pfor_combine_t combine, long identity,
+                 void *arg)
+{
+    int i;
+    long result = identity;
+
+    if (hi <= lo)
+        return identity;
+    if (grain <= 0)
+        grain = (hi - lo) / (32L * pp->nworkers);
+    if (grain < 1)
+        grain = 1;
+
+    /* Post the job; no helper is active between jobs */
+    pthread_mutex_lock(&pp->lock);
+    pp->body = body;
+    pp->combine = combine;
+    pp->arg = arg;
+    pp->grain = grain;
+    pp->remaining = hi - lo;
+    for (i = 0; i < pp->nworkers; i++)
+        pp->w[i].acc = identity;
+    pfor_push(&pp->w[0], lo, hi);
+    pp->running = 1;
+    pp->gen++;
+    pthread_cond_broadcast(&pp->start);
+    pthread_mutex_unlock(&pp->lock);
+
+    pfor_work(pp, &pp->w[0]);
+
+    /* Wait for the helpers to leave, then combine their results */
+    pthread_mutex_lock(&pp->lock);
+    pp->running = 0;
+    while (pp->active > 0)
+        pthread_cond_wait(&pp->done, &pp->lock);
+    pthread_mutex_unlock(&pp->lock);
+    for (i = 0; i < pp->nworkers; i++)
+        result = combine(result, pp->w[i].acc);
+    return result;
+}
+
+typedef struct {             /* Adapts a pfor body to pfor_reduce */
+    void (*body)(long lo, long hi, void *arg);
+    void *arg;
+} pfor_call_t;
+
+static long pfor_call(long lo, long hi, void *vargp)
+{
+    pfor_call_t *cp = vargp;
+
+    cp->body(lo, hi, cp->arg);
+    return 0;
+}
+
+/* pfor - Run body(lo', hi', arg) over a partition of [lo, hi) */
+void pfor(pfor_pool_t *pp, long lo, long hi, long grain,
+          void (*body)(long lo, long hi, void *arg), void *arg)
+{
+    pfor_call_t call;
+
+    call.body = body;
+    call.arg = arg;
+    pfor_reduce(pp, lo, hi, grain, pfor_call, pfor_sum, 0, &call);
+}
+
+/* pfor_sum - Combine function for sums */
+long pfor_sum(long x, long y)
+{
+    return x + y;
+}
@@ -0,0 +1,57 @@
+#ifndef __PFOR_H__
+#define __PFOR_H__
+
+#include "csapp.h"
+
+#define PFOR_CACHELINE  64
+#define PFOR_MAXWORKERS 64
+#define PFOR_DEQUESIZE  128  /* Power of 2; a worker holds < 64 halves */
+
+typedef struct {             /* Half-open index range [lo, hi) */
+    long lo, hi;
+} pfor_range_t;
+
+typedef long (*pfor_body_t)(long lo, long hi, void *arg);
+typedef long (*pfor_combine_t)(long x, long y);
+
+typedef struct {
+    pthread_mutex_t lock;    /* Protects the deque */
+    unsigned top;            /* Thieves take ranges from the top */
+    unsigned bottom;         /* The owner pushes and pops at the bottom */
+    pfor_range_t task[PFOR_DEQUESIZE];
+    long acc;                /* Partial result of this worker */
+    unsigned seed;           /* For picking steal victims */
+    int id;
+    struct pfor_pool *pool;
+} __attribute__((aligned(PFOR_CACHELINE))) pfor_worker_t;
+
+typedef struct pfor_pool {
+    int nworkers;            /* Including the thread that runs a job */
+    pfor_worker_t *w;        /* w[0] is the calling thread */
+    pthread_t *tid;
+
+    /* The current job; set up by the caller under lock */
+    pthread_mutex_t lock;
+    pthread_cond_t start;    /* Signaled when a job is posted */
+    pthread_cond_t done;     /* Signaled when the last helper leaves */
+    unsigned long gen;       /* Bumped for every job */
+    int running;             /* Helpers may still join the job */
+    int active;              /* Helpers working on the job */
+    int quit;
+    pfor_body_t body;
+    pfor_combine_t combine;
+    void *arg;
+    long grain;              /* Ranges this small are not split */
+    long remaining;          /* Indices not yet processed */
+} pfor_pool_t;
+
+pfor_pool_t *pfor_create(int nworkers);
+void pfor_destroy(pfor_pool_t *pp);
+long pfor_reduce(pfor_pool_t *pp, long lo, long hi, long grain,
+                 pfor_body_t body, pfor_combine_t combine, long identity,
+                 void *arg);
+void pfor(pfor_pool_t *pp, long lo, long hi, long grain,
+          void (*body)(long lo, long hi, void *arg), void *arg);
+long pfor_sum(long x, long y);
+
+#endif /* __PFOR_H__ */
@@ -0,0 +1,189 @@
+/*
+ * psum-bench.c - A memory bandwidth benchmark built on the parallel sum.
+ *                Sums an array of 2^log_nelems longs with 1, 2, ...,
+ *                maxthreads threads and reports GB/s and scaling
+ *                efficiency. Unlike psum-array.c, each thread keeps its
+ *                sum in registers and stores it once into its own cache
+ *                line, and the inner loop runs several independent
+ *                accumulators, using AVX2 when the CPU has it.
+ */
+#include "csapp.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif
+
+#define MAXTHREADS 64
+#define CACHELINE  64
+
+typedef struct {            /* Per-thread partial sum, one cache line each */
+    long sum;
+} __attribute__((aligned(CACHELINE))) psum_t;
+
+typedef long (*kernel_t)(const long *a, long n);
+
+void *sum_thread(void *vargp);
+long sum_scalar(const long *a, long n);
+#ifdef HAVE_AVX2_KERNEL
+long sum_avx2(const long *a, long n);
+#endif
+double now(void);
+
+/* Global shared variables */
+long *array;                /* The elements to sum */
+long nelems_per_thread;     /* Number of elements summed by each thread */
+long nthreads;              /* Number of threads in the current run */
+long nelems;
+psum_t psum[MAXTHREADS];    /* Partial sum computed by each thread */
+kernel_t kernel = sum_scalar;
+
+int main(int argc, char **argv)
+{
+    long i, t, r, log_nelems, maxthreads, nruns = 5, result;
+    long myid[MAXTHREADS];
+    double start, best, base = 0, gbs, speedup;
+    char *kname = "scalar";
+    int c, force_scalar = 0;
+    pthread_t tid[MAXTHREADS];
+
+    /* Get input arguments */
+    while ((c = getopt(argc, argv, "sr:")) != -1) {
+	switch (c) {
+	case 's':               /* Compare against the portable kernel */
+	    force_scalar = 1;
+	    break;
+	case 'r':
+	    nruns = atoi(optarg);
+	    break;
+	default:
+	    optind = argc + 1;  /* Force the usage message */
+	}
+    }
+    if (argc - optind != 2) {
+	printf("Usage: %s [-s] [-r runs] <maxthreads> <log_nelems>\n",
+	       argv[0]);
+	exit(0);
+    }
+    maxthreads = atoi(argv[optind]);
+    log_nelems = atoi(argv[optind + 1]);
+    nelems = (1L << log_nelems);
+
+    /* Check input arguments */
+    if (maxthreads < 1 || maxthreads > MAXTHREADS || log_nelems > 31 ||
+	nruns < 1) {
+	printf("Error: invalid arguments\n");
+	exit(0);
+    }
+
+    /* Pick the fastest kernel this CPU can run */
+#ifdef HAVE_AVX2_KERNEL
+    __builtin_cpu_init();
+    if (!force_scalar && __builtin_cpu_supports("avx2")) {
+	kernel = sum_avx2;
+	kname = "avx2";
+    }
+#endif
+
+    array = Malloc(nelems * sizeof(long));
+    for (i = 0; i < nelems; i++)
+	array[i] = i;
+
+    printf("kernel %s, %ld elements (%ld MB), best of %ld runs\n",
+	   kname, nelems, (nelems * sizeof(long)) >> 20, nruns);
+    printf("threads   time(ms)     GB/s  speedup  efficiency\n");
+    for (t = 1; t <= maxthreads; t++) {
+	nelems_per_thread = nelems / t;
+	nthreads = t;
+	best = 0;
+	for (r = 0; r < nruns; r++) {
+	    start = now();
+	    for (i = 0; i < t; i++) {
+		myid[i] = i;
+		Pthread_create(&tid[i], NULL, sum_thread, &myid[i]);
+	    }
+	    for (i = 0; i < t; i++)
+		Pthread_join(tid[i], NULL);
+	    for (i = 0, result = 0; i < t; i++)
+		result += psum[i].sum;
+	    start = now() - start;
+	    if (best == 0 || start < best)
+		best = start;
+
+	    /* Check answer */
+	    if (result != (nelems * (nelems-1))/2)
+		printf("Error: result=%ld\n", result);
+	}
+	if (t == 1)
+	    base = best;
+	gbs = nelems * sizeof(long) / best / 1e9;
+	speedup = base / best;
+	printf("%7ld %10.2f %8.2f %8.2f %10.1f%%\n",
+	       t, best * 1e3, gbs, speedup, 100.0 * speedup / t);
+    }
+    Free(array);
+    exit(0);
+}
+
+/* Thread routine: sum this thread's slice; the last takes the remainder */
+void *sum_thread(void *vargp)
+{
+    long myid = *((long *)vargp);
+    long start = myid * nelems_per_thread;
+    long n = nelems_per_thread;
+
+    if (myid == nthreads - 1)
+	n = nelems - start;
+    psum[myid].sum = kernel(array + start, n);
+    return NULL;
+}
+
+/* Portable kernel: four independent chains instead of one dependent add */
+long sum_scalar(const long *a, long n)
+{
+    long i, s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+	s0 += a[i];
+	s1 += a[i+1];
+	s2 += a[i+2];
+	s3 += a[i+3];
+    }
+    for (; i < n; i++)
+	s0 += a[i];
+    return s0 + s1 + s2 + s3;
+}
+
+#ifdef HAVE_AVX2_KERNEL
+/* AVX2 kernel: four 4-wide accumulators, 16 elements per iteration */
+__attribute__((target("avx2")))
+long sum_avx2(const long *a, long n)
+{
+    __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+    __m256i s2 = _mm256_setzero_si256(), s3 = _mm256_setzero_si256();
+    long i, sum, lane[4];
+    const __m256i *p;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+	p = (const __m256i *)(a + i);
+	s0 = _mm256_add_epi64(s0, _mm256_loadu_si256(p));
+	s1 = _mm256_add_epi64(s1, _mm256_loadu_si256(p + 1));
+	s2 = _mm256_add_epi64(s2, _mm256_loadu_si256(p + 2));
+	s3 = _mm256_add_epi64(s3, _mm256_loadu_si256(p + 3));
+    }
+    s0 = _mm256_add_epi64(_mm256_add_epi64(s0, s1), _mm256_add_epi64(s2, s3));
+    _mm256_storeu_si256((__m256i *)lane, s0);
+    sum = lane[0] + lane[1] + lane[2] + lane[3];
+    for (; i < n; i++)
+	sum += a[i];
+    return sum;
+}
+#endif
+
+/* Return the time in seconds from a monotonic clock */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,52 @@
+/* 
+ * psum-pfor.c - A parallel sum program built on the pfor pool: threads
+ *               persist across runs, ranges are split and stolen on
+ *               demand instead of being partitioned up front, and each
+ *               worker keeps its partial sum in its own cache line
+ */
+#include "csapp.h"
+#include "pfor.h"
+
+long sum_range(long lo, long hi, void *arg); /* Body of the reduction */
+
+int main(int argc, char **argv) 
+{
+    long nelems, log_nelems, nthreads, result;
+    pfor_pool_t *pool;
+
+    /* Get input arguments */
+    if (argc != 3) { 
+	printf("Usage: %s <nthreads> <log_nelems>\n", argv[0]);
+	exit(0);
+    }
+    nthreads = atoi(argv[1]);
+    log_nelems = atoi(argv[2]);
+    nelems = (1L << log_nelems);
+
+    /* Check input arguments */
+    if (nthreads < 1 || log_nelems > 31) {
+	printf("Error: invalid nelems\n");
+	exit(0);
+    }
+
+    /* Sum 0..nelems-1 over a pool of nthreads workers */
+    pool = pfor_create(nthreads);
+    result = pfor_reduce(pool, 0, nelems, 0, sum_range, pfor_sum, 0, NULL);
+    pfor_destroy(pool);
+
+    /* Check final answer */
+    if (result != (nelems * (nelems-1))/2)
+	printf("Error: result=%ld\n", result);
+
+    exit(0);
+}
+
+/* Sum the indices in [lo, hi) */
+long sum_range(long lo, long hi, void *arg) 
+{
+    long i, sum = 0;
+
+    for (i = lo; i < hi; i++)
+	sum += i;
+    return sum;
+}
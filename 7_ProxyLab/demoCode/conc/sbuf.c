@@ -1,3 +1,13 @@
+/*
+ * sbuf.c - A bounded FIFO buffer shared by many producers and consumers.
+ *     Each slot carries a sequence number that says whose turn it is, so
+ *     an insert or remove is one compare-and-swap on rear or front plus
+ *     a store to the slot; no lock is taken while the buffer is neither
+ *     full nor empty. The batch calls claim a run of slots with the same
+ *     single compare-and-swap. A caller that finds it full (or empty)
+ *     spins for a while and then sleeps on a semaphore, which is posted
+ *     only when somebody is known to be sleeping.
+ */
 /* $begin sbufc */
 #include "csapp.h"
 #include "sbuf.h"
@@ -6,12 +16,20 @@
 /* $begin sbuf_init */
 void sbuf_init(sbuf_t *sp, int n)
 {
-    sp->buf = Calloc(n, sizeof(int)); 
+    int i;
+
+    if (n < 2)   /* With one slot, "full at pos" and "free for pos+1" */
+        n = 2;   /* would carry the same sequence number */
+    sp->buf = Calloc(n, sizeof(sbuf_slot_t));
     sp->n = n;                       /* Buffer holds max of n items */
+    for (i = 0; i < n; i++)          /* Slot i takes the item at pos i */
+        sp->buf[i].seq = i;
     sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
-    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
-    Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
-    Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+    /* Spinning only pays if the other side can run meanwhile */
+    sp->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SBUF_SPINS : 0;
+    sp->slotwait = sp->itemwait = 0;
+    Sem_init(&sp->slots, 0, 0);      /* Nobody is sleeping yet */
+    Sem_init(&sp->items, 0, 0);
 }
 /* $end sbuf_init */
 
@@ -19,34 +37,209 @@ void sbuf_init(sbuf_t *sp, int n)
 /* $begin sbuf_deinit */
 void sbuf_deinit(sbuf_t *sp)
 {
+    sem_destroy(&sp->items);
+    sem_destroy(&sp->slots);
     Free(sp->buf);
 }
 /* $end sbuf_deinit */
 
+/* Step to the slot after slot in sp's ring, without a division */
+static inline sbuf_slot_t *sbuf_next(sbuf_t *sp, sbuf_slot_t *slot)
+{
+    return ++slot == sp->buf + sp->n ? sp->buf : slot;
+}
+
+/*
+ * sbuf_run - Count how many slots from slot (for position pos) on hold
+ *     sequence number pos+i+off, up to max; off is 0 for free slots and
+ *     1 for full ones
+ */
+static int sbuf_run(sbuf_t *sp, sbuf_slot_t *slot, unsigned long pos,
+                    int off, int max)
+{
+    int i;
+
+    for (i = 1; i < max; i++) {
+        slot = sbuf_next(sp, slot);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + i + off)
+            break;
+    }
+    return i;
+}
+
+/*
+ * sbuf_try_insert - Insert up to cnt items without blocking, claiming
+ *     all the free slots it can with a single CAS on rear. Returns the
+ *     number inserted, 0 if sp is full.
+ */
+static int sbuf_try_insert(sbuf_t *sp, int *items, int cnt)
+{
+    sbuf_slot_t *slot;
+    unsigned long pos, seq;
+    long dif;
+    int i, k;
+
+    pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &sp->buf[pos % sp->n];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (long)(seq - pos);
+        if (dif == 0) {              /* Slot is free: claim pos and more */
+            k = cnt > 1 ? sbuf_run(sp, slot, pos, 0, cnt) : 1;
+            if (__atomic_compare_exchange_n(&sp->rear, &pos, pos + k, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;               /* On failure pos is reloaded */
+        }
+        else if (dif < 0)            /* Slot still holds an old item */
+            return 0;
+        else                         /* Another producer got there first */
+            pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < k; i++, slot = sbuf_next(sp, slot)) {
+        slot->item = items[i];
+        __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+    return k;
+}
+
+/*
+ * sbuf_try_remove - Remove up to cnt items into items[] without
+ *     blocking, claiming them with a single CAS on front. Returns the
+ *     number removed, 0 if sp is empty.
+ */
+static int sbuf_try_remove(sbuf_t *sp, int *items, int cnt)
+{
+    sbuf_slot_t *slot;
+    unsigned long pos, seq;
+    long dif;
+    int i, k;
+
+    pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &sp->buf[pos % sp->n];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (long)(seq - (pos + 1));
+        if (dif == 0) {              /* Slot is full: claim pos and more */
+            k = cnt > 1 ? sbuf_run(sp, slot, pos, 1, cnt) : 1;
+            if (__atomic_compare_exchange_n(&sp->front, &pos, pos + k, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)            /* Nothing inserted here yet */
+            return 0;
+        else                         /* Another consumer got there first */
+            pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < k; i++, slot = sbuf_next(sp, slot)) {
+        items[i] = slot->item;
+        /* Hand the slot to the producer one lap ahead */
+        __atomic_store_n(&slot->seq, pos + i + sp->n, __ATOMIC_RELEASE);
+    }
+    return k;
+}
+
+/*
+ * sbuf_wake - Wake up to cnt threads sleeping on sem. The fence pairs
+ *     with the one in sbuf_sleep: either the sleeper sees our update when
+ *     it retries, or we see it counted in *waitp. An extra post only
+ *     makes some later sleeper retry once more.
+ */
+static void sbuf_wake(int *waitp, sem_t *sem, int cnt)
+{
+    int n;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    n = __atomic_load_n(waitp, __ATOMIC_RELAXED);
+    for (n = n < cnt ? n : cnt; n > 0; n--)
+        V(sem);
+}
+
+/*
+ * sbuf_sleep - Announce in *waitp that we are about to sleep on sem,
+ *     give try one last chance, and sleep if it fails. Returns what the
+ *     last try returned: 0 after a wakeup.
+ */
+static int sbuf_sleep(sbuf_t *sp, int *waitp, sem_t *sem,
+                      int (*try)(sbuf_t *, int *, int), int *items, int cnt)
+{
+    int done;
+
+    __atomic_add_fetch(waitp, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!(done = try(sp, items, cnt)))
+        P(sem);
+    __atomic_sub_fetch(waitp, 1, __ATOMIC_SEQ_CST);
+    return done;
+}
+
 /* Insert item onto the rear of shared buffer sp */
 /* $begin sbuf_insert */
 void sbuf_insert(sbuf_t *sp, int item)
 {
-    P(&sp->slots);                          /* Wait for available slot */
-    P(&sp->mutex);                          /* Lock the buffer */
-    sp->buf[(++sp->rear)%(sp->n)] = item;   /* Insert the item */
-    V(&sp->mutex);                          /* Unlock the buffer */
-    V(&sp->items);                          /* Announce available item */
+    if (sbuf_try_insert(sp, &item, 1))       /* Fast path: there is room */
+        sbuf_wake(&sp->itemwait, &sp->items, 1);
+    else
+        sbuf_insert_batch(sp, &item, 1);
 }
 /* $end sbuf_insert */
 
+/*
+ * sbuf_insert_batch - Insert items[0..cnt-1] onto the rear of sp, in
+ *     order. While there is room they go in with one CAS.
+ */
+void sbuf_insert_batch(sbuf_t *sp, int *items, int cnt)
+{
+    int k, spins = 0;
+
+    while (cnt > 0) {
+        if (!(k = sbuf_try_insert(sp, items, cnt))) { /* Wait for a slot */
+            if (spins < sp->spins) {
+                spins++;
+                continue;
+            }
+            if (!(k = sbuf_sleep(sp, &sp->slotwait, &sp->slots,
+                                 sbuf_try_insert, items, cnt)))
+                continue;
+        }
+        sbuf_wake(&sp->itemwait, &sp->items, k); /* Announce the items */
+        items += k;
+        cnt -= k;
+    }
+}
+
 /* Remove and return the first item from buffer sp */
 /* $begin sbuf_remove */
 int sbuf_remove(sbuf_t *sp)
 {
     int item;
-    P(&sp->items);                          /* Wait for available item */
-    P(&sp->mutex);                          /* Lock the buffer */
-    item = sp->buf[(++sp->front)%(sp->n)];  /* Remove the item */
-    V(&sp->mutex);                          /* Unlock the buffer */
-    V(&sp->slots);                          /* Announce available slot */
+
+    if (sbuf_try_remove(sp, &item, 1))       /* Fast path: an item is there */
+        sbuf_wake(&sp->slotwait, &sp->slots, 1);
+    else
+        sbuf_remove_batch(sp, &item, 1);
     return item;
 }
 /* $end sbuf_remove */
-/* $end sbufc */
 
+/*
+ * sbuf_remove_batch - Remove up to max items from the front of sp into
+ *     items[], waiting only until there is at least one. Returns the
+ *     number removed.
+ */
+int sbuf_remove_batch(sbuf_t *sp, int *items, int max)
+{
+    int k, spins = 0;
+
+    while (!(k = sbuf_try_remove(sp, items, max))) { /* Wait for an item */
+        if (spins < sp->spins)
+            spins++;
+        else if ((k = sbuf_sleep(sp, &sp->itemwait, &sp->items,
+                                 sbuf_try_remove, items, max)))
+            break;
+    }
+    sbuf_wake(&sp->slotwait, &sp->slots, k);   /* Announce the slots */
+    return k;
+}
+/* $end sbufc */
@@ -3,15 +3,32 @@
 
 #include "csapp.h"
 
+#define SBUF_CACHELINE 64
+#define SBUF_SPINS     256  /* Failed tries before a caller blocks */
+
 /* $begin sbuft */
 typedef struct {
-    int *buf;          /* Buffer array */         
+    unsigned long seq; /* pos when free for insert pos, pos+1 when full */
+    int item;
+} sbuf_slot_t;
+
+typedef struct {
+    sbuf_slot_t *buf;  /* Buffer array */
     int n;             /* Maximum number of slots */
-    int front;         /* buf[(front+1)%n] is first item */
-    int rear;          /* buf[rear%n] is last item */
-    sem_t mutex;       /* Protects accesses to buf */
-    sem_t slots;       /* Counts available slots */
-    sem_t items;       /* Counts available items */
+    int spins;         /* Tries before blocking; 0 on a uniprocessor */
+
+    /* Producers and consumers each own a cache line */
+    unsigned long rear __attribute__((aligned(SBUF_CACHELINE)));
+                       /* Next position to insert at */
+    unsigned long front __attribute__((aligned(SBUF_CACHELINE)));
+                       /* Next position to remove from */
+
+    /* Slow path, touched only when someone has to block */
+    int slotwait __attribute__((aligned(SBUF_CACHELINE)));
+                       /* Producers sleeping on a full buffer */
+    int itemwait;      /* Consumers sleeping on an empty buffer */
+    sem_t slots;       /* Posted when a slot frees up and slotwait > 0 */
+    sem_t items;       /* Posted when an item arrives and itemwait > 0 */
 } sbuf_t;
 /* $end sbuft */
 
@@ -19,5 +36,7 @@ void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
 int sbuf_remove(sbuf_t *sp);
+void sbuf_insert_batch(sbuf_t *sp, int *items, int cnt);
+int sbuf_remove_batch(sbuf_t *sp, int *items, int max);
 
 #endif /* __SBUF_H__ */
@@ -20,7 +20,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -40,7 +42,12 @@
 typedef struct sockaddr SA;
 /* $end sockaddrdef */
 
-/* Persistent state for the robust I/O (Rio) package */
+/*
+ * Persistent state for the robust I/O (Rio) package. rio_bufptr points
+ * into rio_buf, inside the rio_t itself, so a rio_t must not be copied
+ * or moved once it has been initialized: the copy would go on reading
+ * the original's buffer. Pass rio_t's around by pointer.
+ */
 /* $begin rio_t */
 #define RIO_BUFSIZE 8192
 typedef struct {
@@ -56,6 +63,9 @@ extern int h_errno;    /* Defined by BIND for DNS errors */
 extern char **environ; /* Defined by libc */
 
 /* Misc constants */
+#ifndef IOV_MAX
+#define IOV_MAX  1024  /* Max iovecs per writev() call, as on Linux */
+#endif
 #define	MAXLINE	 8192  /* Max text line length */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
@@ -175,16 +185,20 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev_n(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readlineb_view(rio_t *rp, char **linep);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev_n(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd);
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readlineb_view(rio_t *rp, char **linep);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
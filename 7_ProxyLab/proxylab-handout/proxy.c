@@ -1,5 +1,6 @@
 #include "csapp.h"
 #include "wrapper.h"
+#include "scnt.h"
 
 #define DEFAULT_PORT "55556"
 #define MAXPORT 6               /* port <= 65535, five digits */
@@ -10,6 +11,15 @@ int proxy_verbose = 0;
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Largest chunk of a server reply relayed at once */
+#define RELAY_BUFSIZE (64 * 1024)
+
+/* Seconds between statistics reports */
+#define STATS_PERIOD 10
+
+static scnt_t stat_requests;    /* Requests relayed to a server */
+static scnt_t stat_bytes;       /* Reply bytes relayed to clients */
+
 static const char *user_agent_hdr = "\
 User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 \
 Firefox/10.0.3\r\n";
@@ -26,7 +36,20 @@ int main(int argc, char *argv[])
     char                    *port;
     int                      listenfd;
 
+    /* proxy [-v] [port]: -v turns on verbose logging and statistics */
+    if (argc > 1 && !strcmp(argv[1], "-v")) {
+        proxy_verbose = 1;
+        argc--;
+        argv++;
+    }
+
     signal(SIGPIPE, SIG_IGN);
+    scnt_init(&stat_requests);
+    scnt_init(&stat_bytes);
+    if (proxy_verbose) {
+        scnt_report(&stat_requests, "proxy: requests", STATS_PERIOD);
+        scnt_report(&stat_bytes, "proxy: bytes relayed", STATS_PERIOD);
+    }
 
     listenfd = wrap_open_listenfd(port = (argc > 1? argv[1] : DEFAULT_PORT));
     for (;;) {
@@ -81,8 +104,8 @@ int request_and_reply(int connfd, char *request)
 {
     int    clientfd;
     char   hostname[MAXLINE], newrequest[MAX_OBJECT_SIZE], port[MAXPORT];
-    char   buf[MAX_OBJECT_SIZE];
-    rio_t  rp;
+    char   buf[RELAY_BUFSIZE];
+    ssize_t n;
 
     if (parse_request(request, hostname, newrequest, port) < 0) {
         ERR_MSG("wrong request: %s", request);
@@ -94,10 +117,18 @@ int request_and_reply(int connfd, char *request)
         return -1;
     }
     wrap_rio_writen(clientfd, newrequest, strlen(newrequest));
-    rio_readinitb(&rp, clientfd);
-    while (wrap_rio_readlineb(&rp, buf, MAX_OBJECT_SIZE) > 0) {
-        if (wrap_rio_writen(connfd, buf, strlen(buf)) < 0)
+    scnt_add(&stat_requests, 1);
+
+    /*
+     * Relay the reply as it arrives, in chunks of up to 64 KB rather than
+     * line by line. Each read goes straight into buf and is sent on at
+     * once, so nothing is copied twice and a streamed reply is not held
+     * back until 64 KB have come in.
+     */
+    while ((n = wrap_read(clientfd, buf, RELAY_BUFSIZE)) > 0) {
+        if (wrap_rio_writen(connfd, buf, n) < 0)
             break;
+        scnt_add(&stat_bytes, n);
     }
     wrap_close(clientfd);
 
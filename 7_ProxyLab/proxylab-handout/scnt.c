@@ -0,0 +1,76 @@
+/*
+ * scnt.c - Sharded counters: a counter that many threads bump at once
+ *     without sharing a lock or a cache line. Each thread adds into its
+ *     own padded shard; readers sum the shards on demand.
+ */
+#include "csapp.h"
+#include "scnt.h"
+
+static int next_shard = 0;           /* Next shard index to hand out */
+static __thread int my_shard = -1;   /* This thread's shard */
+
+typedef struct {                     /* Arguments of a reporter thread */
+    scnt_t *cp;
+    const char *name;
+    int secs;
+} scnt_reporter_t;
+
+/* Zero all shards of counter cp */
+void scnt_init(scnt_t *cp)
+{
+    memset(cp, 0, sizeof(scnt_t));
+}
+
+/* Add n to counter cp; the hot path touches only this thread's shard */
+void scnt_add(scnt_t *cp, long n)
+{
+    if (my_shard < 0)
+        my_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)
+                   % SCNT_NSHARDS;
+    /* Atomic only because shards are reused once threads outnumber them */
+    __atomic_fetch_add(&cp->shard[my_shard].val, n, __ATOMIC_RELAXED);
+}
+
+/* Return the current total of counter cp */
+long scnt_read(scnt_t *cp)
+{
+    int i;
+    long sum = 0;
+
+    for (i = 0; i < SCNT_NSHARDS; i++)
+        sum += __atomic_load_n(&cp->shard[i].val, __ATOMIC_RELAXED);
+    return sum;
+}
+
+static void *scnt_reporter(void *vargp)
+{
+    scnt_reporter_t *rp = vargp;
+    long total, last = 0;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        sleep(rp->secs);
+        if ((total = scnt_read(rp->cp)) != last) {
+            printf("%s: %ld total (+%ld in %ds)\n",
+                   rp->name, total, total - last, rp->secs);
+            fflush(stdout);
+            last = total;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * scnt_report - Print the total of counter cp every secs seconds from a
+ *     background thread, skipping intervals in which it did not change
+ */
+void scnt_report(scnt_t *cp, const char *name, int secs)
+{
+    pthread_t tid;
+    scnt_reporter_t *rp = Malloc(sizeof(scnt_reporter_t));
+
+    rp->cp = cp;
+    rp->name = name;
+    rp->secs = secs > 0 ? secs : 1;
+    Pthread_create(&tid, NULL, scnt_reporter, rp);
+}
@@ -0,0 +1,23 @@
+#ifndef __SCNT_H__
+#define __SCNT_H__
+
+#include "csapp.h"
+
+#define SCNT_CACHELINE 64
+#define SCNT_NSHARDS   64   /* Threads beyond this share shards */
+
+/* One shard per cache line, so threads never write the same line */
+typedef struct {
+    long val;
+} __attribute__((aligned(SCNT_CACHELINE))) scnt_shard_t;
+
+typedef struct {
+    scnt_shard_t shard[SCNT_NSHARDS];
+} scnt_t;
+
+void scnt_init(scnt_t *cp);
+void scnt_add(scnt_t *cp, long n);
+long scnt_read(scnt_t *cp);
+void scnt_report(scnt_t *cp, const char *name, int secs);
+
+#endif /* __SCNT_H__ */
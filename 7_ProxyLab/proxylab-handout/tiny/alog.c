@@ -0,0 +1,121 @@
+/*
+ * alog.c - buffered, asynchronous access log in Common Log Format
+ *
+ * alog_write() only formats a record into an in-memory buffer. A logger
+ * thread swaps that buffer with a spare one and writes it out when it is
+ * half full, and at least once every ALOG_FLUSH_SECS seconds, so the
+ * server never waits on the log file unless both buffers are full.
+ */
+#include "csapp.h"
+#include "alog.h"
+
+#define ALOG_BUFSIZE    (64 * 1024)
+#define ALOG_MAXREC     (MAXLINE + 256) /* Longest formatted record */
+#define ALOG_FLUSH_SECS 1
+
+static struct {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t full;     /* Signals the logger: flush now */
+    pthread_cond_t swapped;  /* Signals the server: cur has room again */
+    char *cur;               /* Buffer being filled by alog_write */
+    char *spare;             /* Buffer owned by the logger thread */
+    size_t curlen;
+    time_t datesec;          /* Second that date was formatted for */
+    char date[64];           /* Cached "[10/Oct/2000:13:55:36 -0700]" */
+} alog;
+
+/*
+ * alog_thread - write out the filled buffer whenever asked to, or when
+ *     the flush interval expires
+ */
+static void *alog_thread(void *vargp)
+{
+    struct timespec deadline;
+    char *buf;
+    size_t len;
+
+    Pthread_detach(Pthread_self());
+    pthread_mutex_lock(&alog.lock);
+    for (;;) {
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += ALOG_FLUSH_SECS;
+	while (alog.curlen < ALOG_BUFSIZE / 2 &&
+	       pthread_cond_timedwait(&alog.full, &alog.lock, &deadline) == 0)
+	    ;
+	if (alog.curlen == 0)
+	    continue;
+
+	/* Swap buffers, then write without holding the lock */
+	buf = alog.cur;
+	len = alog.curlen;
+	alog.cur = alog.spare;
+	alog.curlen = 0;
+	alog.spare = buf;
+	pthread_cond_broadcast(&alog.swapped);
+	pthread_mutex_unlock(&alog.lock);
+
+	if (rio_writen(alog.fd, buf, len) < 0)
+	    fprintf(stderr, "alog: write error: %s\n", strerror(errno));
+
+	pthread_mutex_lock(&alog.lock);
+    }
+    return NULL;
+}
+
+/*
+ * alog_init - open the log file for appending and start the logger
+ */
+void alog_init(char *path)
+{
+    pthread_t tid;
+
+    /* Close-on-exec: CGI children have no business with the log */
+    alog.fd = Open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, DEF_MODE);
+    pthread_mutex_init(&alog.lock, NULL);
+    pthread_cond_init(&alog.full, NULL);
+    pthread_cond_init(&alog.swapped, NULL);
+    alog.cur = Malloc(ALOG_BUFSIZE);
+    alog.spare = Malloc(ALOG_BUFSIZE);
+    alog.curlen = 0;
+    alog.datesec = -1;
+    Pthread_create(&tid, NULL, alog_thread, NULL);
+}
+
+/*
+ * alog_write - append one record for a request from host
+ *     host - - [date] "request line" status bytes
+ */
+void alog_write(char *host, alog_req_t *req)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+    char bytes[32];
+    int n;
+
+    if (req->bytes < 0)
+	strcpy(bytes, "-");
+    else
+	snprintf(bytes, sizeof(bytes), "%ld", req->bytes);
+
+    pthread_mutex_lock(&alog.lock);
+    while (ALOG_BUFSIZE - alog.curlen < ALOG_MAXREC) {
+	pthread_cond_signal(&alog.full);
+	pthread_cond_wait(&alog.swapped, &alog.lock);
+    }
+
+    /* The timestamp only changes once a second */
+    if (now != alog.datesec) {
+	localtime_r(&now, &tm);
+	strftime(alog.date, sizeof(alog.date), "[%d/%b/%Y:%H:%M:%S %z]", &tm);
+	alog.datesec = now;
+    }
+
+    n = snprintf(alog.cur + alog.curlen, ALOG_MAXREC,
+		 "%.200s - - %s \"%.*s\" %d %s\n", host, alog.date,
+		 MAXLINE, req->line, req->status, bytes);
+    alog.curlen += n < ALOG_MAXREC ? n : ALOG_MAXREC - 1;
+    if (alog.curlen >= ALOG_BUFSIZE / 2)
+	pthread_cond_signal(&alog.full);
+    pthread_mutex_unlock(&alog.lock);
+}
@@ -0,0 +1,19 @@
+/*
+ * alog.h - buffered, asynchronous access log in Common Log Format
+ */
+#ifndef __ALOG_H__
+#define __ALOG_H__
+
+#include "csapp.h"
+
+/* What the server records about one request */
+typedef struct {
+    char line[MAXLINE]; /* Request line without the CRLF, "" if none */
+    int status;         /* HTTP status code sent */
+    long bytes;         /* Body bytes sent, -1 if unknown */
+} alog_req_t;
+
+void alog_init(char *path);
+void alog_write(char *host, alog_req_t *req);
+
+#endif /* __ALOG_H__ */
@@ -0,0 +1,79 @@
+/*
+ * tcgi.c - worker side of Tiny's persistent CGI protocol (see tcgi.h)
+ */
+/* $begin tcgi.c */
+#include "csapp.h"
+#include "tcgi.h"
+
+/*
+ * recv_request - receive one request from Tiny: the query string into
+ *     args and the client socket into *fdp. Returns -1 on EOF or error.
+ */
+static int recv_request(char *args, size_t len, int *fdp)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } u;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = args;
+    iov.iov_len = len - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    while ((n = recvmsg(STDIN_FILENO, &msg, 0)) < 0)
+	if (errno != EINTR)
+	    return -1;
+    if (n == 0)
+	return -1;
+    args[n] = '\0';
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	cmsg->cmsg_type != SCM_RIGHTS)
+	return -1;
+    memcpy(fdp, CMSG_DATA(cmsg), sizeof(int));
+    return 0;
+}
+
+/*
+ * tcgi_accept - finish the previous request, if any, and wait for the
+ *     next one. Returns 1 if there is a request to serve, 0 when the
+ *     program should exit.
+ */
+int tcgi_accept(void)
+{
+    static int nreqs = 0;
+    static char args[MAXLINE];
+    char ack = TCGI_ACK;
+    int clientfd, nullfd;
+
+    if (getenv(TCGI_ENV) == NULL) /* Classic CGI: serve exactly once */
+	return nreqs++ == 0;
+
+    if (nreqs++ > 0) {
+	/* Drop our reference to the client so its connection can close */
+	fflush(stdout);
+	if ((nullfd = open("/dev/null", O_WRONLY)) >= 0) {
+	    dup2(nullfd, STDOUT_FILENO);
+	    close(nullfd);
+	}
+	if (write(STDIN_FILENO, &ack, 1) != 1)
+	    return 0;
+    }
+
+    if (recv_request(args, sizeof(args), &clientfd) < 0)
+	return 0;
+    setenv("QUERY_STRING", args, 1);
+    dup2(clientfd, STDOUT_FILENO);
+    close(clientfd);
+    return 1;
+}
+/* $end tcgi.c */
@@ -0,0 +1,27 @@
+/*
+ * tcgi.h - Tiny's persistent CGI worker protocol
+ *
+ * A CGI program whose body is written as
+ *
+ *     while (tcgi_accept()) {
+ *         ... read QUERY_STRING, write the response to stdout ...
+ *     }
+ *
+ * runs the body once when it is started as a classic CGI program. When
+ * Tiny starts it as a long-lived worker ("tiny -w"), stdin is instead a
+ * Unix socket on which Tiny sends, for each request, the query string
+ * with the client's socket attached (SCM_RIGHTS). tcgi_accept() sets
+ * QUERY_STRING and points stdout at the client, then on the next call
+ * flushes the response and tells Tiny the worker is free again.
+ */
+/* $begin tcgi.h */
+#ifndef __TCGI_H__
+#define __TCGI_H__
+
+#define TCGI_ENV "TINY_CGI_WORKER" /* Set in the environment of workers */
+#define TCGI_ACK 'k'               /* Worker -> Tiny: request finished */
+
+int tcgi_accept(void);
+
+#endif /* __TCGI_H__ */
+/* $end tcgi.h */
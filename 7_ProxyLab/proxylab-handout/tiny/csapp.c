@@ -781,8 +781,66 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev_n - Robustly write all the bytes described by iov[0..iovcnt)
+ *    (unbuffered), picking up a partial write in the middle of an iovec.
+ *    The iovec array is updated in place as bytes are written.
+ */
+/* $begin rio_writev_n */
+ssize_t rio_writev_n(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = 0;
+    ssize_t nwritten;
+    int i, cnt;
 
-/* 
+    for (i = 0; i < iovcnt; i++)
+	n += iov[i].iov_len;
+
+    while (iovcnt > 0) {
+	cnt = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+	if ((nwritten = writev(fd, iov, cnt)) < 0) {
+	    if (errno == EINTR)
+		nwritten = 0;    /* Interrupted by sig handler return */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	/* Drop the iovecs written in full, trim the first partial one */
+	while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (nwritten > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return n;
+}
+/* $end rio_writev_n */
+
+
+/*
+ * rio_fill - Refill the internal buffer via read() if it is empty.
+ *    Returns the number of unread bytes in it, 0 on EOF, -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
+    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR)
+		return -1;
+	} else if (rp->rio_cnt == 0) {  /* EOF */
+	    return 0;
+        } else {
+	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+        }
+    }
+    return rp->rio_cnt;
+}
+
+/*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
  *    buffer, where n is the number of bytes requested by the user and
@@ -795,22 +853,12 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 {
     int cnt;
 
-    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
-	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
-		return -1;
-	}
-	else if (rp->rio_cnt == 0)  /* EOF */
-	    return 0;
-	else 
-	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
-    }
+    if ((cnt = rio_fill(rp)) <= 0)
+	return cnt;     /* EOF or error */
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-    cnt = n;          
-    if (rp->rio_cnt < n)   
+    cnt = n;
+    if (rp->rio_cnt < n)
 	cnt = rp->rio_cnt;
     memcpy(usrbuf, rp->rio_bufptr, cnt);
     rp->rio_bufptr += cnt;
@@ -825,8 +873,8 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
 {
-    rp->rio_fd = fd;  
-    rp->rio_cnt = 0;  
+    rp->rio_fd = fd;
+    rp->rio_cnt = 0;
     rp->rio_bufptr = rp->rio_buf;
 }
 /* $end rio_readinitb */
@@ -853,35 +901,96 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
-/* 
- * rio_readlineb - Robustly read a text line (buffered)
+/*
+ * rio_readlineb - Robustly read a text line (buffered). Rather than
+ *    going through rio_read() a byte at a time, find the newline in the
+ *    internal buffer with memchr() and copy the line out in one piece.
  */
 /* $begin rio_readlineb */
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
-{
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
+ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (n + 1 < maxlen) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;    /* Error */
+	else if (rc == 0) {
+	    if (n == 0)
 		return 0; /* EOF, no data read */
 	    else
 		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+	}
+
+	/* Take what is buffered, up to and including a newline */
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
+	if (nl != NULL)
+	    break;
     }
-    *bufp = 0;
-    return n-1;
+    bufp[n] = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readlineb_view - Read a text line (buffered) without copying it
+ *    out: *linep is set to point at the line inside the internal buffer.
+ *    The line is not NUL-terminated and stays valid only until the next
+ *    read from rp. A line that straddles the end of the buffer is moved
+ *    to the front before more is read behind it; a line longer than the
+ *    whole buffer comes back in buffer-sized pieces. Returns the length
+ *    of the line, 0 on EOF, -1 on error.
+ */
+ssize_t rio_readlineb_view(rio_t *rp, char **linep)
+{
+    size_t cnt, scanned = 0;
+    ssize_t rc;
+    char *nl;
+
+    if (rp->rio_cnt < 0)        /* Left over from a failed read */
+	rp->rio_cnt = 0;
+    for (;;) {
+	cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr + scanned, '\n', cnt - scanned))) {
+	    cnt = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	if (cnt == sizeof(rp->rio_buf))
+	    break;              /* Longer than the buffer */
+	scanned = cnt;
+
+	/* Keep the partial line contiguous and read behind it */
+	if (rp->rio_bufptr != rp->rio_buf) {
+	    memmove(rp->rio_buf, rp->rio_bufptr, cnt);
+	    rp->rio_bufptr = rp->rio_buf;
+	}
+	while ((rc = read(rp->rio_fd, rp->rio_buf + cnt,
+			  sizeof(rp->rio_buf) - cnt)) < 0)
+	    if (errno != EINTR)
+		return -1;      /* errno set by read() */
+	if (rc == 0) {
+	    if (cnt == 0)
+		return 0;       /* EOF, no data read */
+	    else
+		break;          /* EOF, some data was read */
+	}
+	rp->rio_cnt += rc;
+    }
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -900,6 +1009,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writev_n(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writev_n(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writev_n error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -923,6 +1038,15 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_readlineb_view(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readlineb_view(rp, linep)) < 0)
+	unix_error("Rio_readlineb_view error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -3,16 +3,90 @@
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
  *     GET method to serve static and dynamic content.
  */
+#include <poll.h>
 #include "csapp.h"
+#include "cgi-bin/tcgi.h"
+#include "alog.h"
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+/* Content codings that Tiny can serve from precompressed files */
+#define ENC_IDENTITY 0
+#define ENC_GZIP     1
+#define ENC_BR       2
+#define NENCODINGS   3
+
+static const struct {
+    char *token;  /* Accept-Encoding/Content-Encoding token */
+    char *suffix; /* Appended to the file name, e.g. foo.html.gz */
+} encodings[NENCODINGS] = {
+    { "identity", "" },
+    { "gzip", ".gz" },
+    { "br", ".br" },
+};
+
+/* Static-file cache: remembers which precompressed variants exist
+   and how large each one is */
+#define SCACHE_SIZE 64
+typedef struct {
+    int valid;
+    char filename[MAXLINE];
+    time_t mtime;  /* mtime and size of the uncompressed file */
+    off_t size;
+    int variants;  /* Bitmask of (1 << ENC_*) present on disk */
+    off_t varsize[NENCODINGS];  /* Size of each variant present */
+} scache_entry_t;
+
+static scache_entry_t scache[SCACHE_SIZE];
+
+/* Append-only buffer for building response headers (hb_*) */
+typedef struct {
+    char buf[MAXBUF];
+    size_t len;
+} hdrbuf_t;
+
+static const char server_line[] = "Server: Tiny Web Server\r\n";
+
+/* Content-type header line per file extension, the last is the default */
+static const struct {
+    char *ext;
+    char *line;
+} filetypes[] = {
+    { ".html", "Content-type: text/html\r\n" },
+    { ".gif", "Content-type: image/gif\r\n" },
+    { ".png", "Content-type: image/png\r\n" },
+    { ".jpg", "Content-type: image/jpeg\r\n" },
+    { NULL, "Content-type: text/plain\r\n" },
+};
+
+/* Persistent CGI workers (tiny -w), one pool per CGI program */
+#define MAXPOOLS   8
+#define MAXWORKERS 64
+typedef struct {
+    char filename[MAXLINE];  /* CGI program, "" if the slot is unused */
+    pid_t pid[MAXWORKERS];   /* Worker processes */
+    int sock[MAXWORKERS];    /* Our end of each worker's socket */
+    int busy[MAXWORKERS];    /* Serving a request, no ack yet */
+} cgipool_t;
+
+static int nworkers = 0;     /* Workers per pool; 0 = fork per request */
+static cgipool_t cgipools[MAXPOOLS];
+
+/* Logging options */
+static int quiet = 0;        /* Don't echo requests and headers (-q) */
+static int logging = 0;      /* Write an access log (-l file) */
+static int niflags = 0;      /* Getnameinfo flags; numeric with -n */
+
+void doit(int fd, alog_req_t *req);
+void read_requesthdrs(rio_t *rp, int *accepted);
+int parse_accept_encoding(char *value);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
-void get_filetype(char *filename, char *filetype);
+scache_entry_t *scache_lookup(char *filename, struct stat *sbuf);
+int pick_encoding(scache_entry_t *ent, int accepted);
+int serve_static(int fd, char *filename, scache_entry_t *ent, int enc);
+const char *get_filetype(char *filename);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum,
-		 char *shortmsg, char *longmsg);
+int cgipool_dispatch(int fd, char *filename, char *cgiargs);
+int clienterror(int fd, char *cause, char *errnum,
+		char *shortmsg, char *longmsg);
 
 int main(int argc, char **argv)
 {
@@ -20,96 +94,178 @@ int main(int argc, char **argv)
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    alog_req_t req;
+    int c;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((c = getopt(argc, argv, "w:nql:")) != -1) {
+	switch (c) {
+	case 'n': /* Numeric addresses: no reverse DNS per connection */
+	    niflags = NI_NUMERICHOST | NI_NUMERICSERV;
+	    break;
+	case 'q':
+	    quiet = 1;
+	    break;
+	case 'l':
+	    alog_init(optarg);
+	    logging = 1;
+	    break;
+	case 'w': /* Serve CGI from persistent workers */
+	    nworkers = atoi(optarg);
+	    if (nworkers < 0 || nworkers > MAXWORKERS) {
+		fprintf(stderr, "%s: -w takes 0 to %d workers\n",
+			argv[0], MAXWORKERS);
+		exit(1);
+	    }
+	    break;
+	default:
+	    optind = argc; /* Force the usage message */
+	    break;
+	}
+    }
+    if (argc - optind != 1) {
+	fprintf(stderr, "usage: %s [-nq] [-l logfile] [-w nworkers] <port>\n",
+		argv[0]);
 	exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd(argv[optind]);
+    /* CGI programs, pool workers above all, must not keep the port bound */
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-	doit(connfd);                                             //line:netp:tiny:doit
+	if (!quiet || logging)
+	    Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
+			port, MAXLINE, niflags);
+	if (!quiet)
+	    printf("Accepted connection from (%s, %s)\n", hostname, port);
+	doit(connfd, &req);                                       //line:netp:tiny:doit
 	Close(connfd);                                            //line:netp:tiny:close
+	if (logging && req.line[0] != '\0')
+	    alog_write(hostname, &req);
     }
 }
 /* $end tinymain */
 
 /*
- * doit - handle one HTTP request/response transaction
+ * doit - handle one HTTP request/response transaction, recording the
+ *     outcome in *req for the access log
  */
 /* $begin doit */
-void doit(int fd)
+void doit(int fd, alog_req_t *req)
 {
-    int is_static;
+    int is_static, accepted, enc;
+    scache_entry_t *ent;
     struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
     rio_t rio;
 
     /* Read request line and headers */
+    req->line[0] = '\0';
+    req->bytes = -1;
     Rio_readinitb(&rio, fd);
     if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
         return;
-    printf("%s", buf);
+    if (!quiet)
+	printf("%s", buf);
+    snprintf(req->line, MAXLINE, "%.*s", (int)strcspn(buf, "\r\n"), buf);
     sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
-        clienterror(fd, method, "501", "Not Implemented",
-                    "Tiny does not implement this method");
+        req->status = 501;
+        req->bytes = clienterror(fd, method, "501", "Not Implemented",
+                                 "Tiny does not implement this method");
         return;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    read_requesthdrs(&rio, &accepted);                   //line:netp:doit:readrequesthdrs
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
     if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
-	clienterror(fd, filename, "404", "Not found",
-		    "Tiny couldn't find this file");
+	req->status = 404;
+	req->bytes = clienterror(fd, filename, "404", "Not found",
+				 "Tiny couldn't find this file");
 	return;
     }                                                    //line:netp:doit:endnotfound
 
     if (is_static) { /* Serve static content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't read the file");
+	    req->status = 403;
+	    req->bytes = clienterror(fd, filename, "403", "Forbidden",
+				     "Tiny couldn't read the file");
 	    return;
 	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+	ent = scache_lookup(filename, &sbuf);
+	enc = pick_encoding(ent, accepted);
+	req->status = 200;
+	req->bytes = serve_static(fd, filename, ent, enc); //line:netp:doit:servestatic
     }
     else { /* Serve dynamic content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't run the CGI program");
+	    req->status = 403;
+	    req->bytes = clienterror(fd, filename, "403", "Forbidden",
+				     "Tiny couldn't run the CGI program");
 	    return;
 	}
+	req->status = 200;
 	serve_dynamic(fd, filename, cgiargs);            //line:netp:doit:servedynamic
     }
 }
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read and discard HTTP request headers, noting in
+ *     *accepted the content codings the client will take
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp)
+void read_requesthdrs(rio_t *rp, int *accepted)
 {
-    char buf[MAXLINE];
+    char *line, value[MAXLINE];
+    ssize_t n;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
+    /* Header lines are looked at in place in rp's buffer, never copied */
+    *accepted = 1 << ENC_IDENTITY;
+    while ((n = Rio_readlineb_view(rp, &line)) > 0) {
+	if (!quiet)
+	    printf("%.*s", (int)n, line);
+	if (n == 2 && !memcmp(line, "\r\n", 2))      //line:netp:readhdrs:checkterm
+	    break;
+	if (n > 16 && !strncasecmp(line, "Accept-Encoding:", 16)) {
+	    snprintf(value, sizeof(value), "%.*s", (int)n - 16, line + 16);
+	    *accepted = parse_accept_encoding(value);
+	}
     }
     return;
 }
 /* $end read_requesthdrs */
 
+/*
+ * parse_accept_encoding - return the bitmask of codings in an
+ *     Accept-Encoding value that Tiny knows; "q=0" refuses a coding.
+ *     Modifies value in place.
+ */
+int parse_accept_encoding(char *value)
+{
+    char *tok, *params, *q, *saveptr;
+    int i, mask = 1 << ENC_IDENTITY;
+
+    for (tok = strtok_r(value, ",", &saveptr); tok != NULL;
+	 tok = strtok_r(NULL, ",", &saveptr)) {
+	while (isspace(*tok))
+	    tok++;
+	if ((params = strchr(tok, ';')) != NULL)
+	    *params++ = '\0';
+	tok[strcspn(tok, " \t\r\n")] = '\0';
+	if (params && (q = strstr(params, "q=")) && strtod(q + 2, NULL) == 0.0)
+	    continue;
+	for (i = ENC_IDENTITY + 1; i < NENCODINGS; i++)
+	    if (!strcasecmp(tok, encodings[i].token))
+		mask |= 1 << i;
+    }
+    return mask;
+}
+
 /*
  * parse_uri - parse URI into filename and CGI args
  *             return 0 if dynamic content, 1 if static
@@ -143,48 +299,203 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client
+ * scache_hash - string hash for the static-file cache
+ */
+static unsigned int scache_hash(char *s)
+{
+    unsigned int h = 5381;
+
+    while (*s)
+	h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+/*
+ * scache_lookup - return the static-file cache entry for filename. The
+ *     disk is probed for filename.gz and filename.br only when the entry
+ *     is new or the uncompressed file has changed since it was cached.
+ */
+scache_entry_t *scache_lookup(char *filename, struct stat *sbuf)
+{
+    scache_entry_t *ent = &scache[scache_hash(filename) % SCACHE_SIZE];
+    char varname[MAXLINE];
+    struct stat vbuf;
+    int i;
+
+    if (ent->valid && !strcmp(ent->filename, filename) &&
+	ent->mtime == sbuf->st_mtime && ent->size == sbuf->st_size)
+	return ent;
+
+    strcpy(ent->filename, filename);
+    ent->mtime = sbuf->st_mtime;
+    ent->size = sbuf->st_size;
+    ent->variants = 1 << ENC_IDENTITY;
+    ent->varsize[ENC_IDENTITY] = sbuf->st_size;
+    for (i = ENC_IDENTITY + 1; i < NENCODINGS; i++) {
+	/* A variant older than the original is stale; ignore it */
+	snprintf(varname, MAXLINE, "%s%s", filename, encodings[i].suffix);
+	if (stat(varname, &vbuf) == 0 && S_ISREG(vbuf.st_mode) &&
+	    (S_IRUSR & vbuf.st_mode) && vbuf.st_mtime >= sbuf->st_mtime) {
+	    ent->variants |= 1 << i;
+	    ent->varsize[i] = vbuf.st_size;
+	}
+    }
+    ent->valid = 1;
+    return ent;
+}
+
+/*
+ * pick_encoding - choose the smallest variant the client accepts, going
+ *     by the sizes recorded in the cache entry; ties keep the uncompressed
+ *     file or the earlier encoding in encodings[]
+ */
+int pick_encoding(scache_entry_t *ent, int accepted)
+{
+    int i, best = ENC_IDENTITY;
+    int avail = ent->variants & accepted;
+
+    for (i = ENC_IDENTITY + 1; i < NENCODINGS; i++)
+	if ((avail & (1 << i)) && ent->varsize[i] < ent->varsize[best])
+	    best = i;
+    return best;
+}
+
+/*
+ * date_line - return the Date header line, formatted at most once a second
+ */
+static const char *date_line(void)
+{
+    static time_t cached = -1;
+    static char line[64];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (now != cached) {
+	gmtime_r(&now, &tm);
+	strftime(line, sizeof(line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n",
+		 &tm);
+	cached = now;
+    }
+    return line;
+}
+
+/*
+ * hb_append - append n bytes to a header buffer. A header that does not
+ *     fit is dropped whole rather than cut short.
+ */
+static void hb_append(hdrbuf_t *hb, const char *s, size_t n)
+{
+    if (hb->len + n <= sizeof(hb->buf)) {
+	memcpy(hb->buf + hb->len, s, n);
+	hb->len += n;
+    }
+}
+
+static void hb_puts(hdrbuf_t *hb, const char *s)
+{
+    hb_append(hb, s, strlen(s));
+}
+
+static void hb_printf(hdrbuf_t *hb, const char *fmt, ...)
+{
+    size_t room = sizeof(hb->buf) - hb->len;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(hb->buf + hb->len, room, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && (size_t)n < room)
+	hb->len += n;
+}
+
+/*
+ * hb_start - begin a response: status line, then Date and Server
+ */
+static void hb_start(hdrbuf_t *hb, const char *status)
+{
+    hb->len = 0;
+    hb_puts(hb, status);
+    hb_puts(hb, date_line());
+    hb_append(hb, server_line, sizeof(server_line) - 1);
+}
+
+/*
+ * send_response - send a finished header block and the body that
+ *     follows it with one gathering write, so a small response leaves
+ *     in a single packet
+ */
+static void send_response(int fd, hdrbuf_t *hb, void *body, size_t bodylen)
+{
+    struct iovec iov[2];
+
+    iov[0].iov_base = hb->buf;
+    iov[0].iov_len = hb->len;
+    iov[1].iov_base = body;
+    iov[1].iov_len = bodylen;
+    Rio_writev_n(fd, iov, bodylen > 0 ? 2 : 1);
+    if (!quiet) {
+	printf("Response headers:\n");
+	printf("%.*s", (int)hb->len, hb->buf);
+    }
+}
+
+/*
+ * serve_static - copy a file, or its precompressed variant enc, back
+ *     to the client; returns the number of body bytes sent
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize)
-{
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
-
-    /* Send response headers to client */
-    get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
-    printf("Response headers:\n");
-    printf("%s", buf);
-
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
+int serve_static(int fd, char *filename, scache_entry_t *ent, int enc)
+{
+    int srcfd, filesize;
+    char *srcp, srcname[MAXLINE];
+    struct stat sbuf;
+    hdrbuf_t hb;
+
+    /* Open the body first: a variant deleted since it was cached
+       drops the entry and falls back to the uncompressed file */
+    snprintf(srcname, MAXLINE, "%s%s", filename, encodings[enc].suffix);
+    if ((srcfd = open(srcname, O_RDONLY, 0)) < 0) {
+	ent->valid = 0;
+	enc = ENC_IDENTITY;
+	srcfd = Open(filename, O_RDONLY, 0); //line:netp:servestatic:open
+    }
+    Fstat(srcfd, &sbuf);
+    filesize = sbuf.st_size;
+
+    /* Build response headers */
+    hb_start(&hb, "HTTP/1.0 200 OK\r\n");   //line:netp:servestatic:beginserve
+    hb_puts(&hb, "Connection: close\r\n");
+    hb_printf(&hb, "Content-length: %d\r\n", filesize);
+    if (enc != ENC_IDENTITY)
+	hb_printf(&hb, "Content-encoding: %s\r\n", encodings[enc].token);
+    if (ent->variants != 1 << ENC_IDENTITY)
+	hb_puts(&hb, "Vary: Accept-Encoding\r\n");
+    hb_puts(&hb, get_filetype(filename));   //line:netp:servestatic:getfiletype
+    hb_puts(&hb, "\r\n");
+
+    /* Send response headers and body to client */
+    if (filesize > 0) {
+	srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
+	send_response(fd, &hb, srcp, filesize); //line:netp:servestatic:write
+	Munmap(srcp, filesize);             //line:netp:servestatic:munmap
+    } else
+	send_response(fd, &hb, NULL, 0);    //line:netp:servestatic:endserve
     Close(srcfd);                           //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);         //line:netp:servestatic:write
-    Munmap(srcp, filesize);                 //line:netp:servestatic:munmap
+    return filesize;
 }
 
 /*
- * get_filetype - derive file type from file name
+ * get_filetype - derive the Content-type header line from file name
  */
-void get_filetype(char *filename, char *filetype)
+const char *get_filetype(char *filename)
 {
-    if (strstr(filename, ".html"))
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".png"))
-	strcpy(filetype, "image/png");
-    else if (strstr(filename, ".jpg"))
-	strcpy(filetype, "image/jpeg");
-    else
-	strcpy(filetype, "text/plain");
+    int i;
+
+    for (i = 0; filetypes[i].ext != NULL; i++)
+	if (strstr(filename, filetypes[i].ext))
+	    break;
+    return filetypes[i].line;
 }
 /* $end serve_static */
 
@@ -194,47 +505,206 @@ void get_filetype(char *filename, char *filetype)
 /* $begin serve_dynamic */
 void serve_dynamic(int fd, char *filename, char *cgiargs)
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    char *emptylist[] = { NULL };
+    hdrbuf_t hb;
+    pid_t pid;
 
     /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    hb_start(&hb, "HTTP/1.0 200 OK\r\n");
+    send_response(fd, &hb, NULL, 0);
+
+    if (nworkers > 0 && cgipool_dispatch(fd, filename, cgiargs) == 0)
+	return;
 
-    if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
+    if ((pid = Fork()) == 0) { /* Child */ //line:netp:servedynamic:fork
 	/* Real server would set all CGI vars here */
 	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
 	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
 	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
     }
-    Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    /* Parent waits for and reaps this child; a bare wait() could reap
+       a pool worker instead and leave the CGI child a zombie */
+    Waitpid(pid, NULL, 0); //line:netp:servedynamic:wait
 }
 /* $end serve_dynamic */
 
 /*
- * clienterror - returns an error message to the client
+ * cgipool_spawn - start worker i of pool; fd is the client connection
+ *     being served, which the worker must not hold on to
+ */
+static void cgipool_spawn(cgipool_t *pool, int i, int fd)
+{
+    int sv[2], nullfd;
+    char *emptylist[] = { NULL };
+
+    /* Close-on-exec keeps our ends out of the other workers */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+	unix_error("socketpair error");
+    if ((pool->pid[i] = Fork()) == 0) { /* Child */
+	Close(fd);
+	Dup2(sv[1], STDIN_FILENO);  /* Requests arrive on stdin */
+	nullfd = Open("/dev/null", O_WRONLY, 0);
+	Dup2(nullfd, STDOUT_FILENO);
+	if (nullfd != STDOUT_FILENO)
+	    Close(nullfd);
+	setenv(TCGI_ENV, "1", 1);
+	Execve(pool->filename, emptylist, environ);
+    }
+    Close(sv[1]);
+    pool->sock[i] = sv[0];
+    pool->busy[i] = 0;
+}
+
+/*
+ * cgipool_respawn - replace a worker that exited or stopped responding
+ */
+static void cgipool_respawn(cgipool_t *pool, int i, int fd)
+{
+    Close(pool->sock[i]);
+    kill(pool->pid[i], SIGKILL);
+    waitpid(pool->pid[i], NULL, 0);
+    cgipool_spawn(pool, i, fd);
+}
+
+/*
+ * cgipool_get - find or start the pool for a CGI program. Returns NULL
+ *     if all pool slots are taken by other programs.
+ */
+static cgipool_t *cgipool_get(char *filename, int fd)
+{
+    cgipool_t *pool;
+    int i;
+
+    for (pool = cgipools; pool < cgipools + MAXPOOLS; pool++) {
+	if (!strcmp(pool->filename, filename))
+	    return pool;
+	if (pool->filename[0] == '\0') {
+	    strcpy(pool->filename, filename);
+	    for (i = 0; i < nworkers; i++)
+		cgipool_spawn(pool, i, fd);
+	    return pool;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * cgipool_idle - return an idle worker of pool, collecting the acks of
+ *     finished requests and waiting for one if every worker is busy
+ */
+static int cgipool_idle(cgipool_t *pool, int fd)
+{
+    struct pollfd pfds[MAXWORKERS];
+    char ack;
+    int i, idle;
+
+    for (;;) {
+	idle = 0;
+	for (i = 0; i < nworkers; i++) {
+	    pfds[i].fd = pool->busy[i] ? pool->sock[i] : -1;
+	    pfds[i].events = POLLIN;
+	    pfds[i].revents = 0;
+	    idle |= !pool->busy[i];
+	}
+	/* Only block when every worker is busy */
+	if (poll(pfds, nworkers, idle ? 0 : -1) < 0 && errno != EINTR)
+	    unix_error("poll error");
+	for (i = 0; i < nworkers; i++) {
+	    if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+		continue;
+	    if (read(pool->sock[i], &ack, 1) == 1 && ack == TCGI_ACK)
+		pool->busy[i] = 0;
+	    else /* Worker died mid-request */
+		cgipool_respawn(pool, i, fd);
+	}
+	for (i = 0; i < nworkers; i++)
+	    if (!pool->busy[i])
+		return i;
+    }
+}
+
+/*
+ * cgipool_send - hand cgiargs and the client socket fd to a worker
+ */
+static int cgipool_send(int sock, char *cgiargs, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } u;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = cgiargs;
+    iov.iov_len = strlen(cgiargs);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/*
+ * cgipool_dispatch - serve a dynamic request from a persistent worker
+ *     instead of fork+execve. The worker writes the rest of the response
+ *     straight to fd, so we return without waiting for it. Returns -1 if
+ *     no pool is available and the caller should fork as usual.
+ */
+int cgipool_dispatch(int fd, char *filename, char *cgiargs)
+{
+    cgipool_t *pool;
+    int i;
+
+    if ((pool = cgipool_get(filename, fd)) == NULL)
+	return -1;
+    i = cgipool_idle(pool, fd);
+    if (cgipool_send(pool->sock[i], cgiargs, fd) < 0) {
+	/* Worker went away while idle; one retry with a fresh one */
+	cgipool_respawn(pool, i, fd);
+	if (cgipool_send(pool->sock[i], cgiargs, fd) < 0)
+	    return -1;
+    }
+    pool->busy[i] = 1;
+    return 0;
+}
+
+/*
+ * clienterror - returns an error message to the client; returns the
+ *     length of the message body
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum,
-		 char *shortmsg, char *longmsg)
+int clienterror(int fd, char *cause, char *errnum,
+		char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char status[MAXLINE], body[MAXBUF];
+    int bodylen;
+    hdrbuf_t hb;
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+    bodylen = snprintf(body, MAXBUF,
+		       "<html><title>Tiny Error</title>"
+		       "<body bgcolor=""ffffff"">\r\n"
+		       "%s: %s\r\n"
+		       "<p>%s: %s\r\n"
+		       "<hr><em>The Tiny Web server</em>\r\n",
+		       errnum, shortmsg, longmsg, cause);
+    if (bodylen >= MAXBUF)
+	bodylen = MAXBUF - 1;
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    snprintf(status, MAXLINE, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    hb_start(&hb, status);
+    hb_puts(&hb, filetypes[0].line); /* text/html */
+    hb_printf(&hb, "Content-length: %d\r\n\r\n", bodylen);
+    send_response(fd, &hb, body, bodylen);
+    return bodylen;
 }
 /* $end clienterror */
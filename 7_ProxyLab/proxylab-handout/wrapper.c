@@ -55,6 +55,20 @@ ssize_t wrap_rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 }
 
+ssize_t wrap_read(int fd, void *usrbuf, size_t n)
+{
+    ssize_t rc;
+
+    while ((rc = read(fd, usrbuf, n)) < 0) {
+        if (errno == EINTR)
+            continue;
+        perror("err: read");
+        return -1;
+    }
+    VERBOSE_MSG("fd%d> %zd bytes", fd, rc);
+    return rc;
+}
+
 int wrap_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
     int rc;
@@ -19,6 +19,7 @@ int wrap_open_listenfd(char *port);
 int wrap_open_clientfd(char *hostname, char *port);
 ssize_t wrap_rio_writen(int fd, void *usrbuf, size_t n);
 ssize_t wrap_rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t wrap_read(int fd, void *usrbuf, size_t n);
 int wrap_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
 void wrap_close(int fd);
 int wrap_pthread_create(pthread_t *tidp, pthread_attr_t *attrp,